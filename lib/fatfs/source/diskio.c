@@ -30,96 +30,1515 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  *
- * This diskio implementation assumes that all calls to the FatFs API are made from
- * RP2040 core 0 and the MSC USB host stack is running on core 1. Otherwise, the
- * API needs some mechanism to block until the USB transfers between the USB drive
- * and the RP2040 complete (e.g., an RTOS or manually task calls in a loop)
+ * The FatFs API and the disk functions may be called from either RP2040 core.
+ * Each drive has a recursive mutex that is held for every disk function, so
+ * the two cores can work on different drives in parallel; FatFs locks each
+ * volume the same way (see ffsystem.c). State shared by all the drives, such
+ * as the read-ahead pool, has a lock of its own that is only ever taken while
+ * holding a drive lock.
+ *
+ * Only the core that runs tuh_task() (MSC_FAT_USB_CORE) issues commands
+ * to the drives. Requests from the other core are handed over through
+ * single-producer/single-consumer rings; the drive lock makes its holder the
+ * only producer. The waiting core sleeps in __wfe() until the completion
+ * callback signals with __sev(). The USB core cannot sleep, so it runs
+ * tuh_task() and msc_fat_usb_task() while it waits for a transfer or a
+ * lock. It never waits inside a tinyusb callback: an unplugged drive whose
+ * lock is busy is cleaned up later by msc_fat_task().
  */
 
 #include "ff.h"			/* Obtains integer types */
 #include "diskio.h"		/* Declarations of disk functions */
 #include "tusb.h"
-#include "pico/mutex.h"
+#include "pico/platform.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
 #if CFG_TUH_MSC
 
-static DSTATUS disk_state[CFG_TUH_DEVICE_MAX];
-static mutex_t msc_fat_mutex;
+static DSTATUS disk_state[FF_VOLUMES];
+
+// Transfer status of each physical drive; see msc_fat_get_xfer_status()
+static msc_fat_xfer_status_t xfer_status[FF_VOLUMES];
+
+// Logical block size of each drive (FF_MIN_SS..FF_MAX_SS); set by disk_initialize()
+static WORD sector_size[FF_VOLUMES];
+
+static msc_fat_limits_t drive_limits[FF_VOLUMES];
+
+/*-----------------------------------------------------------------------*/
+/* Per-drive request queues                                              */
+/*-----------------------------------------------------------------------*/
+static_assert((MSC_FAT_QUEUE_DEPTH & (MSC_FAT_QUEUE_DEPTH - 1)) == 0 && MSC_FAT_QUEUE_DEPTH <= 128,
+    "MSC_FAT_QUEUE_DEPTH must be a power of 2 no larger than 128");
+
+// Each ring has one producer and one consumer. The submitter produces
+// sq and the USB core consumes it; the USB core produces cq and
+// msc_fat_reap() consumes it. Each index is stored only by its owner.
+typedef struct {
+    msc_fat_io_t* sq[MSC_FAT_QUEUE_DEPTH]; // submission ring; sq[sq_head] is on the bus when busy
+    msc_fat_io_t* cq[MSC_FAT_QUEUE_DEPTH]; // completion ring for requests with no complete_cb
+    uint8_t sq_head;    // the indices are free running; mask them to get the array index
+    uint8_t sq_tail;
+    uint8_t cq_head;
+    uint8_t cq_tail;
+    bool busy;          // true if the request at sq_head has been issued; USB core only
+} msc_fat_queue_t;
+
+#define MSC_FAT_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define MSC_FAT_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+
+static msc_fat_queue_t io_queue[FF_VOLUMES];
+
+// A drive's caches, buffers and queue belong to the core that holds its
+// lock. shared_lock guards what the drives share: the read-ahead pool and
+// the scratch buffers for probing and trim.
+static recursive_mutex_t drive_lock[FF_VOLUMES];
+static recursive_mutex_t shared_lock;
+
+// Set by msc_fat_unplug() until the drive's cached state is discarded
+static volatile bool unplug_pending[FF_VOLUMES];
+// Set when cached writes were discarded; see msc_fat_writes_lost()
+static volatile bool writes_lost[FF_VOLUMES];
+/*-----------------------------------------------------------------------*/
+/* MSC plug status functions                                             */
+/*-----------------------------------------------------------------------*/
+static uint8_t pdrv_to_daddr_map[FF_VOLUMES];
+static uint8_t available_pdrv_bitmap;
+
+/**
+ * @brief convert the physical drive number to a USB device address
+ *
+ * @param pdrv the physical drive number 0-(FF_VOLUMES-1)
+ * @return uint8_t the USB device address of the drive or 0 if pdrv is no present
+ */
+uint8_t msc_pdrv_to_daddr(uint8_t pdrv)
+{
+    return pdrv_to_daddr_map[pdrv];
+}
+
+
+#define SCSI_CMD_READ_16 0x88
+#define SCSI_CMD_WRITE_16 0x8A
+#define SCSI_CMD_SERVICE_ACTION_IN_16 0x9E
+#define SCSI_SA_READ_CAPACITY_16 0x10
+
+/**
+ * @brief convert a USB device address to a physical drive number
+ *
+ * @param daddr USB device address
+ * @return uint8_t the physical drive number or FF_VOLUMES if daddr is not a drive
+ */
+uint8_t msc_daddr_to_pdrv(uint8_t daddr)
+{
+    uint8_t pdrv = FF_VOLUMES;
+    if (daddr == 0)
+        return pdrv; // 0 marks an unmapped drive, so it is never a drive's address
+    for (size_t idx = 0; idx < sizeof(pdrv_to_daddr_map); idx++)
+    {
+        if (pdrv_to_daddr_map[idx] == daddr)
+        {
+            pdrv = idx;
+            break;
+        }
+    }
+    return pdrv;
+}
+
+uint8_t msc_map_next_pdrv(uint8_t daddr)
+{
+    uint8_t next_drive_plus_1 = __builtin_ffs(available_pdrv_bitmap);
+    assert(next_drive_plus_1 != 0 && next_drive_plus_1 <= FF_VOLUMES);
+    uint8_t pdrv = next_drive_plus_1 - 1;
+    available_pdrv_bitmap &= ~(1 << pdrv); // clear the available drive bit
+    pdrv_to_daddr_map[pdrv] = daddr;
+    return pdrv;
+}
+
+uint8_t msc_unmap_pdrv(uint8_t daddr)
+{
+    uint8_t pdrv = msc_daddr_to_pdrv(daddr);
+    if (pdrv < FF_VOLUMES)
+    {
+        available_pdrv_bitmap |= (1 << pdrv); // set the available drive bit
+        pdrv_to_daddr_map[pdrv] = 0;
+    }
+    return pdrv;
+}
+
+static void msc_fat_io_finish(msc_fat_io_t* io, msc_fat_xfer_status_t stat)
+{
+    if (io->complete_cb)
+    {
+        MSC_FAT_STORE(io->status, stat);
+        io->complete_cb(io);
+    }
+    else
+    {
+        msc_fat_queue_t* q = &io_queue[io->pdrv];
+        q->cq[q->cq_tail & (MSC_FAT_QUEUE_DEPTH - 1)] = io;
+        MSC_FAT_STORE(q->cq_tail, q->cq_tail + 1);
+        MSC_FAT_STORE(io->status, stat);
+    }
+    __sev(); // wake the other core if it is waiting for this request
+}
+
+static bool msc_fat_queue_complete_cb(uint8_t dev_addr, tuh_msc_complete_data_t const* cb_data);
+
+static bool msc_fat_issue(msc_fat_io_t* io)
+{
+    uint8_t dev_addr = msc_pdrv_to_daddr(io->pdrv);
+    if (io->op == MSC_FAT_OP_SCSI)
+        return tuh_msc_scsi_command(dev_addr, io->cbw, io->buff, msc_fat_queue_complete_cb, (uintptr_t)io);
+    if (io->sector + io->count > UINT32_MAX)
+    {
+        // READ(16) and WRITE(16) for sectors past 2^32; tinyusb copies the CBW
+        msc_cbw_t cbw;
+        msc_fat_cbw_init(&cbw, 16, io->count * sector_size[io->pdrv], io->op == MSC_FAT_OP_READ);
+        cbw.command[0] = io->op == MSC_FAT_OP_READ ? SCSI_CMD_READ_16 : SCSI_CMD_WRITE_16;
+        for (int idx = 0; idx < 8; idx++)
+            cbw.command[2 + idx] = (uint64_t)io->sector >> (56 - 8 * idx);
+        cbw.command[12] = io->count >> 8;
+        cbw.command[13] = io->count;
+        return tuh_msc_scsi_command(dev_addr, &cbw, io->buff, msc_fat_queue_complete_cb, (uintptr_t)io);
+    }
+    if (io->op == MSC_FAT_OP_READ)
+        return tuh_msc_read10(dev_addr, 0, io->buff, io->sector, io->count, msc_fat_queue_complete_cb, (uintptr_t)io);
+    return tuh_msc_write10(dev_addr, 0, io->buff, io->sector, io->count, msc_fat_queue_complete_cb, (uintptr_t)io);
+}
+
+/**
+ * @brief if the drive is idle, issue the request at the head of its submission ring
+ *
+ * Must only be called on MSC_FAT_USB_CORE. Requests that tinyusb refuses
+ * to start are completed with MSC_FAT_ERROR and the next request is tried.
+ */
+static void msc_fat_kick(BYTE pdrv)
+{
+    msc_fat_queue_t* q = &io_queue[pdrv];
+    while (!q->busy && q->sq_head != MSC_FAT_LOAD(q->sq_tail))
+    {
+        msc_fat_io_t* io = q->sq[q->sq_head & (MSC_FAT_QUEUE_DEPTH - 1)];
+        if (msc_fat_issue(io))
+        {
+            q->busy = true;
+        }
+        else
+        {
+            MSC_FAT_STORE(q->sq_head, q->sq_head + 1);
+            msc_fat_io_finish(io, MSC_FAT_ERROR);
+        }
+    }
+}
+
+static bool msc_fat_queue_complete_cb(uint8_t dev_addr, tuh_msc_complete_data_t const* cb_data)
+{
+    msc_fat_io_t* io = (msc_fat_io_t*)cb_data->user_arg;
+    uint8_t pdrv = msc_daddr_to_pdrv(dev_addr);
+    if (pdrv != io->pdrv)
+        return false; // stale completion from a drive that has since been unplugged
+    msc_fat_queue_t* q = &io_queue[pdrv];
+    bool passed = cb_data->csw->status == MSC_CSW_STATUS_PASSED;
+    msc_fat_xfer_status_t stat = passed ? MSC_FAT_COMPLETE : MSC_FAT_ERROR;
+    MSC_FAT_STORE(q->sq_head, q->sq_head + 1);
+    q->busy = false;
+    MSC_FAT_STORE(xfer_status[pdrv], stat);
+    // Put the next CBW on the bus before handing this request back
+    msc_fat_kick(pdrv);
+    msc_fat_io_finish(io, stat);
+    return passed;
+}
+
+/**
+ * @brief fail every request queued on the drive; used when the drive is unplugged
+ *
+ * The command on the bus, if any, will never complete, so it is failed too.
+ * Must only be called on MSC_FAT_USB_CORE.
+ */
+static void msc_fat_abort_queue(BYTE pdrv)
+{
+    msc_fat_queue_t* q = &io_queue[pdrv];
+    q->busy = false;
+    while (q->sq_head != MSC_FAT_LOAD(q->sq_tail))
+    {
+        msc_fat_io_t* io = q->sq[q->sq_head & (MSC_FAT_QUEUE_DEPTH - 1)];
+        MSC_FAT_STORE(q->sq_head, q->sq_head + 1);
+        msc_fat_io_finish(io, MSC_FAT_ERROR);
+    }
+}
+
+void msc_fat_usb_task()
+{
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
+        msc_fat_kick(pdrv);
+}
+
+bool msc_fat_submit(msc_fat_io_t* io)
+{
+    if (io == NULL || io->pdrv >= FF_VOLUMES)
+        return false;
+    if (io->op == MSC_FAT_OP_SCSI ? io->cbw == NULL : (io->buff == NULL || io->count == 0 || io->count > UINT16_MAX))
+        return false;
+    if (disk_state[io->pdrv] & (STA_NODISK | STA_NOINIT))
+        return false;
+    msc_fat_queue_t* q = &io_queue[io->pdrv];
+    uint8_t tail = q->sq_tail;
+    uint8_t in_use = (uint8_t)(tail - MSC_FAT_LOAD(q->sq_head));
+    if (io->complete_cb == NULL)
+        in_use += (uint8_t)(MSC_FAT_LOAD(q->cq_tail) - q->cq_head); // leave room to post the completion
+    if (in_use >= MSC_FAT_QUEUE_DEPTH)
+        return false;
+    MSC_FAT_STORE(io->status, MSC_FAT_IN_PROGRESS);
+    q->sq[tail & (MSC_FAT_QUEUE_DEPTH - 1)] = io;
+    MSC_FAT_STORE(q->sq_tail, tail + 1);
+    if (get_core_num() == MSC_FAT_USB_CORE)
+        msc_fat_kick(io->pdrv);
+    // else msc_fat_usb_task() on the USB core picks it up
+    return true;
+}
+
+static bool msc_fat_submit_op(msc_fat_io_t* io, msc_fat_op_t op, BYTE pdrv, BYTE* buff, LBA_t sector, UINT count,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg)
+{
+    io->op = op;
+    io->pdrv = pdrv;
+    io->buff = buff;
+    io->sector = sector;
+    io->count = count;
+    io->complete_cb = complete_cb;
+    io->user_arg = user_arg;
+    return msc_fat_submit(io);
+}
+
+bool msc_fat_read_async(msc_fat_io_t* io, BYTE pdrv, BYTE* buff, LBA_t sector, UINT count,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg)
+{
+    return msc_fat_submit_op(io, MSC_FAT_OP_READ, pdrv, buff, sector, count, complete_cb, user_arg);
+}
+
+bool msc_fat_scsi_async(msc_fat_io_t* io, BYTE pdrv, const msc_cbw_t* cbw, void* data,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg)
+{
+    io->cbw = cbw;
+    return msc_fat_submit_op(io, MSC_FAT_OP_SCSI, pdrv, (BYTE*)data, 0, 0, complete_cb, user_arg);
+}
+
+void msc_fat_cbw_init(msc_cbw_t* cbw, uint8_t cmd_len, uint32_t total_bytes, bool dir_in)
+{
+    memset(cbw, 0, sizeof(*cbw));
+    cbw->signature = MSC_CBW_SIGNATURE;
+    cbw->tag = 0x54555342; // "TUSB", the same tag tinyusb uses
+    cbw->total_bytes = total_bytes;
+    cbw->dir = dir_in ? TUSB_DIR_IN_MASK : 0;
+    cbw->lun = 0;
+    cbw->cmd_len = cmd_len;
+}
+
+msc_fat_io_t* msc_fat_reap(BYTE pdrv)
+{
+    msc_fat_io_t* io = NULL;
+    if (pdrv < FF_VOLUMES)
+    {
+        msc_fat_queue_t* q = &io_queue[pdrv];
+        if (q->cq_head != MSC_FAT_LOAD(q->cq_tail))
+        {
+            io = q->cq[q->cq_head & (MSC_FAT_QUEUE_DEPTH - 1)];
+            MSC_FAT_STORE(q->cq_head, q->cq_head + 1);
+        }
+    }
+    return io;
+}
+
+/**
+ * @brief wait for something to happen that might complete a transfer
+ *
+ * The USB core has to keep the USB host stack running, so it runs only
+ * the USB work; any other core sleeps until a completion callback
+ * executes __sev().
+ */
+static void msc_fat_wait_event()
+{
+    if (get_core_num() == MSC_FAT_USB_CORE)
+    {
+        tuh_task();
+        msc_fat_usb_task();
+    }
+    else
+    {
+        __wfe();
+    }
+}
+
+void msc_fat_io_wait(msc_fat_io_t* io)
+{
+    while (MSC_FAT_LOAD(io->status) == MSC_FAT_IN_PROGRESS)
+    {
+        msc_fat_wait_event();
+    }
+}
+
+bool msc_fat_mutex_enter(recursive_mutex_t* mtx, uint32_t timeout_ms)
+{
+    if (get_core_num() != MSC_FAT_USB_CORE)
+    {
+        if (timeout_ms == MSC_FAT_WAIT_FOREVER)
+        {
+            recursive_mutex_enter_blocking(mtx);
+            return true;
+        }
+        return recursive_mutex_enter_timeout_ms(mtx, timeout_ms);
+    }
+    // The owner may be waiting for a transfer that only this core can finish
+    absolute_time_t until = make_timeout_time_ms(timeout_ms);
+    while (!recursive_mutex_try_enter(mtx, NULL))
+    {
+        if (timeout_ms != MSC_FAT_WAIT_FOREVER && time_reached(until))
+            return false;
+        msc_fat_wait_event();
+    }
+    return true;
+}
+
+void msc_fat_lock(BYTE pdrv)
+{
+    msc_fat_mutex_enter(&drive_lock[pdrv], MSC_FAT_WAIT_FOREVER);
+}
+
+void msc_fat_unlock(BYTE pdrv)
+{
+    recursive_mutex_exit(&drive_lock[pdrv]);
+}
+
+static void msc_fat_shared_enter()
+{
+    msc_fat_mutex_enter(&shared_lock, MSC_FAT_WAIT_FOREVER);
+}
+
+static void msc_fat_shared_exit()
+{
+    recursive_mutex_exit(&shared_lock);
+}
+
+static void msc_fat_io_sync_cb(msc_fat_io_t* io)
+{
+    (void)io; // the caller is polling io->status
+}
+
+/*-----------------------------------------------------------------------*/
+/* Sequential read-ahead                                                 */
+/*-----------------------------------------------------------------------*/
+#if MSC_FAT_READAHEAD_BUFFERS
+// Each drive tracks one sequential read stream. Once two reads in a row
+// are contiguous, up to MSC_FAT_READAHEAD_DEPTH buffers from the shared
+// pool are queued to read the sectors that follow the stream while the
+// caller works on the data it has. A stray single-sector read (e.g., a
+// FAT sector) does not end the stream.
+#define MSC_FAT_READAHEAD_DEPTH 2
+
+typedef struct {
+    msc_fat_io_t io;    // io.pdrv owns the buffer; io.sector and io.count are the sectors it holds
+    uint32_t last_used; // value of ra_clock when the buffer was last filled or read
+    bool in_use;
+    bool stale;         // the drive was written after the read was queued; free it once io completes
+} msc_fat_ra_buf_t;
+
+typedef struct {
+    LBA_t next_sector;  // the sector that continues the stream
+    LBA_t candidate;    // the sector that would start a new stream
+    uint8_t run;        // number of contiguous reads in the stream
+} msc_fat_ra_stream_t;
+
+static msc_fat_ra_buf_t ra_buf[MSC_FAT_READAHEAD_BUFFERS];
+static_assert(MSC_FAT_READAHEAD_SECTORS * FF_MIN_SS >= FF_MAX_SS, "a read-ahead buffer must hold at least one FF_MAX_SS sector");
+
+// Each buffer holds MSC_FAT_READAHEAD_SECTORS FF_MIN_SS sectors or fewer larger ones
+static BYTE ra_data[MSC_FAT_READAHEAD_BUFFERS][MSC_FAT_READAHEAD_SECTORS * FF_MIN_SS] __attribute__((aligned(4)));
+static msc_fat_ra_stream_t ra_stream[FF_VOLUMES];
+static uint32_t ra_clock;
+
+static bool msc_fat_ra_overlaps(msc_fat_ra_buf_t* rab, LBA_t sector, UINT count)
+{
+    return rab->io.sector < sector + count && sector < rab->io.sector + rab->io.count;
+}
+
+/**
+ * @brief find the drive's usable buffer that holds or will hold the sector
+ *
+ * @return int the buffer index or -1 if there is none
+ */
+static int msc_fat_ra_find(BYTE pdrv, LBA_t sector)
+{
+    for (int idx = 0; idx < MSC_FAT_READAHEAD_BUFFERS; idx++)
+    {
+        msc_fat_ra_buf_t* rab = &ra_buf[idx];
+        if (rab->in_use && !rab->stale && rab->io.pdrv == pdrv && msc_fat_ra_overlaps(rab, sector, 1))
+            return idx;
+    }
+    return -1;
+}
+
+/**
+ * @brief get a free buffer, reclaiming the least recently used buffer whose read is done
+ *
+ * @return int the buffer index or -1 if every buffer has a read in progress
+ */
+static int msc_fat_ra_alloc()
+{
+    int victim = -1;
+    for (int idx = 0; idx < MSC_FAT_READAHEAD_BUFFERS; idx++)
+    {
+        msc_fat_ra_buf_t* rab = &ra_buf[idx];
+        if (!rab->in_use)
+            return idx;
+        if (MSC_FAT_LOAD(rab->io.status) == MSC_FAT_IN_PROGRESS)
+            continue; // the drive still owns the memory
+        if (rab->stale)
+            return idx;
+        if (victim < 0 || rab->last_used < ra_buf[victim].last_used)
+            victim = idx;
+    }
+    return victim;
+}
+
+/**
+ * @brief keep stale data from being read; called before sectors are written to the drive
+ */
+static void msc_fat_ra_invalidate(BYTE pdrv, LBA_t sector, UINT count)
+{
+    for (int idx = 0; idx < MSC_FAT_READAHEAD_BUFFERS; idx++)
+    {
+        msc_fat_ra_buf_t* rab = &ra_buf[idx];
+        if (rab->in_use && rab->io.pdrv == pdrv && msc_fat_ra_overlaps(rab, sector, count))
+            rab->stale = true;
+    }
+}
+
+/**
+ * @brief release all the drive's buffers; its queued reads must have been aborted
+ */
+static void msc_fat_ra_discard(BYTE pdrv)
+{
+    for (int idx = 0; idx < MSC_FAT_READAHEAD_BUFFERS; idx++)
+    {
+        if (ra_buf[idx].io.pdrv == pdrv)
+            ra_buf[idx].in_use = false;
+    }
+    memset(&ra_stream[pdrv], 0, sizeof(ra_stream[pdrv]));
+}
+
+/**
+ * @brief copy as many sectors from the front of the request as the read-ahead buffers hold
+ *
+ * On return, *buff, *sector and *count describe what is left to read from the drive.
+ */
+static void msc_fat_ra_take(BYTE pdrv, BYTE** buff, LBA_t* sector, UINT* count)
+{
+    int idx;
+    msc_fat_shared_enter();
+    while (*count != 0 && (idx = msc_fat_ra_find(pdrv, *sector)) >= 0)
+    {
+        msc_fat_ra_buf_t* rab = &ra_buf[idx];
+        if (MSC_FAT_LOAD(rab->io.status) == MSC_FAT_IN_PROGRESS)
+        {
+            // Other drives may use the pool meanwhile; once the read is
+            // done they can reclaim the buffer, so look it up again
+            msc_fat_shared_exit();
+            msc_fat_io_wait(&rab->io);
+            msc_fat_shared_enter();
+            continue;
+        }
+        if (rab->io.status != MSC_FAT_COMPLETE)
+        {
+            rab->in_use = false;
+            break;
+        }
+        UINT offset = *sector - rab->io.sector;
+        UINT nsect = rab->io.count - offset;
+        if (nsect > *count)
+            nsect = *count;
+        memcpy(*buff, ra_data[idx] + offset * sector_size[pdrv], nsect * sector_size[pdrv]);
+        *buff += nsect * sector_size[pdrv];
+        *sector += nsect;
+        *count -= nsect;
+        rab->last_used = ++ra_clock;
+        if (offset + nsect == rab->io.count)
+            rab->in_use = false; // the stream has consumed the whole buffer
+    }
+    msc_fat_shared_exit();
+}
+
+/**
+ * @brief queue reads so the sectors that follow the stream are in the read-ahead buffers
+ */
+static void msc_fat_ra_fill(BYTE pdrv)
+{
+    LBA_t block_count = drive_limits[pdrv].block_count;
+    LBA_t start = ra_stream[pdrv].next_sector;
+    for (int depth = 0; depth < MSC_FAT_READAHEAD_DEPTH && start < block_count; depth++)
+    {
+        int idx = msc_fat_ra_find(pdrv, start);
+        if (idx < 0)
+        {
+            idx = msc_fat_ra_alloc();
+            if (idx < 0)
+                break;
+            UINT nsect = sizeof(ra_data[idx]) / sector_size[pdrv];
+            if (nsect > block_count - start)
+                nsect = block_count - start;
+            msc_fat_ra_buf_t* rab = &ra_buf[idx];
+            rab->in_use = true;
+            rab->stale = false;
+            rab->last_used = ++ra_clock;
+            if (!msc_fat_read_async(&rab->io, pdrv, ra_data[idx], start, nsect, msc_fat_io_sync_cb, 0))
+            {
+                rab->in_use = false;
+                break;
+            }
+        }
+        start = ra_buf[idx].io.sector + ra_buf[idx].io.count;
+    }
+}
+
+/**
+ * @brief update the drive's stream with a completed read and read ahead if it is sequential
+ */
+static void msc_fat_ra_track(BYTE pdrv, LBA_t sector, UINT count)
+{
+    msc_fat_ra_stream_t* stream = &ra_stream[pdrv];
+    if (stream->run != 0 && sector == stream->next_sector)
+    {
+        if (stream->run < UINT8_MAX)
+            stream->run++;
+    }
+    else if (sector == stream->candidate)
+    {
+        stream->run = 1;
+    }
+    else
+    {
+        stream->candidate = sector + count;
+        return;
+    }
+    stream->next_sector = sector + count;
+    msc_fat_shared_enter();
+    msc_fat_ra_fill(pdrv);
+    msc_fat_shared_exit();
+}
+#endif
+
+#if MSC_FAT_TRIM_RANGES
+static bool msc_fat_trim_overlaps(BYTE pdrv, LBA_t sector, UINT count);
+static void msc_fat_trim_flush(BYTE pdrv);
+#endif
+
+/**
+ * @brief queue one request and block until it completes
+ */
+static DRESULT msc_fat_xfer(BYTE pdrv, msc_fat_op_t op, BYTE* buff, LBA_t sector, UINT count)
+{
+    msc_fat_io_t io;
+#if MSC_FAT_READAHEAD_BUFFERS
+    if (op == MSC_FAT_OP_WRITE)
+    {
+        msc_fat_shared_enter();
+        msc_fat_ra_invalidate(pdrv, sector, count);
+        msc_fat_shared_exit();
+    }
+#endif
+#if MSC_FAT_TRIM_RANGES
+    if (op == MSC_FAT_OP_WRITE && msc_fat_trim_overlaps(pdrv, sector, count))
+        msc_fat_trim_flush(pdrv);
+#endif
+    if (!msc_fat_submit_op(&io, op, pdrv, buff, sector, count, msc_fat_io_sync_cb, 0))
+        return RES_ERROR;
+    msc_fat_io_wait(&io);
+    return io.status == MSC_FAT_COMPLETE ? RES_OK : RES_ERROR;
+}
+
+/**
+ * @brief queue one SCSI command and block until it completes
+ */
+static DRESULT msc_fat_scsi(BYTE pdrv, const msc_cbw_t* cbw, void* data)
+{
+    msc_fat_io_t io;
+    if (!msc_fat_scsi_async(&io, pdrv, cbw, data, msc_fat_io_sync_cb, 0))
+        return RES_ERROR;
+    msc_fat_io_wait(&io);
+    return io.status == MSC_FAT_COMPLETE ? RES_OK : RES_ERROR;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Drive limits from the vital product data (VPD) pages                  */
+/*-----------------------------------------------------------------------*/
+#define SCSI_VPD_SUPPORTED_PAGES 0x00
+#define SCSI_VPD_BLOCK_LIMITS 0xB0
+#define SCSI_VPD_LOGICAL_BLOCK_PROVISIONING 0xB2
+
+static uint32_t msc_fat_get_be32(const uint8_t* buf)
+{
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static void msc_fat_put_be32(uint8_t* buf, uint32_t val)
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static void msc_fat_put_be64(uint8_t* buf, uint64_t val)
+{
+    msc_fat_put_be32(buf, val >> 32);
+    msc_fat_put_be32(buf + 4, (uint32_t)val);
+}
+
+static DRESULT msc_fat_inquiry_vpd(BYTE pdrv, uint8_t page, uint8_t* resp, uint8_t resp_len)
+{
+    msc_cbw_t cbw;
+    msc_fat_cbw_init(&cbw, 6, resp_len, true);
+    cbw.command[0] = SCSI_CMD_INQUIRY;
+    cbw.command[1] = 1; // EVPD
+    cbw.command[2] = page;
+    cbw.command[4] = resp_len;
+    memset(resp, 0, resp_len);
+    return msc_fat_scsi(pdrv, &cbw, resp);
+}
+
+/**
+ * @brief read the drive's Block Limits and Logical Block Provisioning pages
+ *
+ * Many flash drives do not implement VPD pages; they just get no limits.
+ */
+static void msc_fat_read_limits(BYTE pdrv)
+{
+    msc_fat_limits_t* limits = &drive_limits[pdrv];
+    memset(limits, 0, sizeof(*limits));
+    uint8_t resp[64];
+    if (msc_fat_inquiry_vpd(pdrv, SCSI_VPD_SUPPORTED_PAGES, resp, sizeof(resp)) != RES_OK)
+        return;
+    bool has_block_limits = false;
+    bool has_provisioning = false;
+    for (int idx = 4; idx < 4 + resp[3] && idx < (int)sizeof(resp); idx++)
+    {
+        has_block_limits |= resp[idx] == SCSI_VPD_BLOCK_LIMITS;
+        has_provisioning |= resp[idx] == SCSI_VPD_LOGICAL_BLOCK_PROVISIONING;
+    }
+    if (has_block_limits && msc_fat_inquiry_vpd(pdrv, SCSI_VPD_BLOCK_LIMITS, resp, sizeof(resp)) == RES_OK)
+    {
+        limits->opt_xfer_gran = (resp[6] << 8) | resp[7];
+        limits->max_xfer_blocks = msc_fat_get_be32(resp + 8);
+        limits->max_unmap_blocks = msc_fat_get_be32(resp + 20);
+        limits->max_unmap_ranges = msc_fat_get_be32(resp + 24);
+        limits->unmap_gran = msc_fat_get_be32(resp + 28) & 0x7FFFFFFF;
+        limits->max_write_same_blocks = ((uint64_t)msc_fat_get_be32(resp + 36) << 32) | msc_fat_get_be32(resp + 40);
+    }
+    if (has_provisioning && msc_fat_inquiry_vpd(pdrv, SCSI_VPD_LOGICAL_BLOCK_PROVISIONING, resp, 8) == RES_OK)
+    {
+        limits->unmap = (resp[5] & 0x80) != 0;
+        limits->write_same_unmap = (resp[5] & 0x40) != 0;
+    }
+}
+
+/**
+ * @brief get the drive's block count, using READ CAPACITY(16) when the
+ * count tinyusb read with READ CAPACITY(10) does not fit in 32 bits
+ */
+static void msc_fat_read_capacity(BYTE pdrv)
+{
+    msc_fat_limits_t* limits = &drive_limits[pdrv];
+    limits->block_count = tuh_msc_get_block_count(msc_pdrv_to_daddr(pdrv), 0);
+    if (limits->block_count != 0 && limits->block_count != UINT32_MAX)
+        return; // the last LBA 0xFFFFFFFF makes the count 0 or all ones
+    msc_cbw_t cbw;
+    uint8_t resp[32];
+    msc_fat_cbw_init(&cbw, 16, sizeof(resp), true);
+    cbw.command[0] = SCSI_CMD_SERVICE_ACTION_IN_16;
+    cbw.command[1] = SCSI_SA_READ_CAPACITY_16;
+    msc_fat_put_be32(cbw.command + 10, sizeof(resp));
+    if (msc_fat_scsi(pdrv, &cbw, resp) == RES_OK)
+    {
+        uint64_t last_lba = ((uint64_t)msc_fat_get_be32(resp) << 32) | msc_fat_get_be32(resp + 4);
+        limits->block_count = last_lba + 1;
+    }
+}
+
+#define MSC_FAT_MAX_ERASE_BLOCK 32768 // the largest block size f_mkfs() accepts
+
+static BYTE sector_buf[FF_MAX_SS]; // scratch sector for probing and WRITE SAME
+
+static uint32_t msc_fat_floor_pow2(uint32_t val)
+{
+    uint32_t pow2 = 1;
+    while (pow2 <= val / 2)
+        pow2 <<= 1;
+    return pow2;
+}
+
+/**
+ * @brief set the erase block size the drive reports through GET_BLOCK_SIZE
+ *
+ * Drives that do not report an optimal transfer length granularity get the
+ * alignment of their first partition, since the factory format puts the
+ * partition on an erase block boundary. Unpartitioned drives get a guess
+ * based on capacity: about 1/1024 of the drive, at most 4 MB.
+ */
+static void msc_fat_probe_erase_block(BYTE pdrv)
+{
+    msc_fat_limits_t* limits = &drive_limits[pdrv];
+    uint32_t block = limits->opt_xfer_gran;
+    if (block == 0)
+    {
+        msc_fat_shared_enter(); // for sector_buf
+        if (msc_fat_xfer(pdrv, MSC_FAT_OP_READ, sector_buf, 0, 1) == RES_OK &&
+            sector_buf[510] == 0x55 && sector_buf[511] == 0xAA &&
+            sector_buf[0] != 0xEB && sector_buf[0] != 0xE9) // not a volume boot record
+        {
+            const BYTE* part = sector_buf + 446;
+            uint32_t start = part[8] | (part[9] << 8) | (part[10] << 16) | ((uint32_t)part[11] << 24);
+            if (part[4] != 0 && part[4] != 0xEE && start != 0)
+                block = start & -start; // largest power of 2 that divides the start sector
+        }
+        msc_fat_shared_exit();
+    }
+    if (block == 0)
+    {
+        uint32_t max_block = (4u << 20) / sector_size[pdrv];
+        block = limits->block_count / 1024 > max_block ? max_block : limits->block_count / 1024;
+    }
+    if (block > MSC_FAT_MAX_ERASE_BLOCK)
+        block = MSC_FAT_MAX_ERASE_BLOCK;
+    limits->erase_block = msc_fat_floor_pow2(block);
+}
+
+const msc_fat_limits_t* msc_fat_get_limits(BYTE pdrv)
+{
+    return pdrv < FF_VOLUMES ? &drive_limits[pdrv] : NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Trim                                                                  */
+/*-----------------------------------------------------------------------*/
+#if MSC_FAT_TRIM_RANGES
+// Ranges passed to CTRL_TRIM are collected per drive and sent in one
+// UNMAP command when the list is full or the drive is flushed. A write
+// that overlaps a collected range sends the list first so the UNMAP can
+// never land after new data in a reallocated cluster.
+#define SCSI_CMD_UNMAP 0x42
+#define SCSI_CMD_WRITE_SAME_16 0x93
+
+typedef struct {
+    LBA_t sector;
+    uint32_t count;
+} msc_fat_trim_range_t;
+
+static msc_fat_trim_range_t trim_ranges[FF_VOLUMES][MSC_FAT_TRIM_RANGES];
+static uint8_t trim_count[FF_VOLUMES];
+static uint8_t trim_param[8 + 16 * MSC_FAT_TRIM_RANGES];
+
+static bool msc_fat_trim_supported(BYTE pdrv)
+{
+    return drive_limits[pdrv].unmap || drive_limits[pdrv].write_same_unmap;
+}
+
+static bool msc_fat_trim_overlaps(BYTE pdrv, LBA_t sector, UINT count)
+{
+    for (int idx = 0; idx < trim_count[pdrv]; idx++)
+    {
+        msc_fat_trim_range_t* range = &trim_ranges[pdrv][idx];
+        if (range->sector < sector + count && sector < range->sector + range->count)
+            return true;
+    }
+    return false;
+}
+
+static void msc_fat_trim_flush(BYTE pdrv)
+{
+    int nranges = trim_count[pdrv];
+    trim_count[pdrv] = 0;
+    if (nranges == 0 || !msc_fat_trim_supported(pdrv))
+        return; // a failed flush turned trim off; never send the rest
+    DRESULT res = RES_OK;
+    msc_cbw_t cbw;
+    msc_fat_shared_enter(); // for trim_param and sector_buf
+    if (drive_limits[pdrv].unmap)
+    {
+        uint16_t param_len = 8 + 16 * nranges;
+        memset(trim_param, 0, param_len);
+        trim_param[0] = (param_len - 2) >> 8;
+        trim_param[1] = (param_len - 2);
+        trim_param[2] = (16 * nranges) >> 8;
+        trim_param[3] = (16 * nranges);
+        for (int idx = 0; idx < nranges; idx++)
+        {
+            msc_fat_put_be64(trim_param + 8 + 16 * idx, trim_ranges[pdrv][idx].sector);
+            msc_fat_put_be32(trim_param + 16 + 16 * idx, trim_ranges[pdrv][idx].count);
+        }
+        msc_fat_cbw_init(&cbw, 10, param_len, false);
+        cbw.command[0] = SCSI_CMD_UNMAP;
+        cbw.command[7] = param_len >> 8;
+        cbw.command[8] = param_len;
+        res = msc_fat_scsi(pdrv, &cbw, trim_param);
+    }
+    else
+    {
+        memset(sector_buf, 0, sector_size[pdrv]);
+        for (int idx = 0; idx < nranges && res == RES_OK; idx++)
+        {
+            msc_fat_cbw_init(&cbw, 16, sector_size[pdrv], false);
+            cbw.command[0] = SCSI_CMD_WRITE_SAME_16;
+            cbw.command[1] = 0x08; // UNMAP
+            msc_fat_put_be64(cbw.command + 2, trim_ranges[pdrv][idx].sector);
+            msc_fat_put_be32(cbw.command + 10, trim_ranges[pdrv][idx].count);
+            res = msc_fat_scsi(pdrv, &cbw, sector_buf);
+        }
+    }
+    msc_fat_shared_exit();
+    if (res != RES_OK)
+    {
+        // Do not risk it again; trim is only a hint
+        drive_limits[pdrv].unmap = false;
+        drive_limits[pdrv].write_same_unmap = false;
+    }
+}
+
+/**
+ * @brief add the inclusive range of sectors to the drive's trim list
+ *
+ * Ranges are split so none is longer than the drive allows. Trim is only
+ * a hint, so this never fails; if a flush fails, the drive's trim
+ * support is turned off and the rest of the range is dropped.
+ */
+static DRESULT msc_fat_trim(BYTE pdrv, LBA_t start, LBA_t end)
+{
+    if (!msc_fat_trim_supported(pdrv) || end < start)
+        return RES_OK;
+    uint32_t max_ranges = drive_limits[pdrv].unmap ? drive_limits[pdrv].max_unmap_ranges : MSC_FAT_TRIM_RANGES;
+    if (max_ranges == 0 || max_ranges > MSC_FAT_TRIM_RANGES)
+        max_ranges = MSC_FAT_TRIM_RANGES;
+    uint32_t max_blocks;
+    if (drive_limits[pdrv].unmap)
+    {
+        max_blocks = drive_limits[pdrv].max_unmap_blocks;
+        if (max_blocks == 0)
+            max_blocks = UINT32_MAX;
+    }
+    else
+    {
+        // A drive may zero every block of a WRITE SAME, so without a
+        // reported limit keep each one short enough to finish within
+        // the USB timeout
+        uint64_t max_same = drive_limits[pdrv].max_write_same_blocks;
+        if (max_same == 0)
+            max_blocks = MSC_FAT_WRITE_SAME_BLOCKS;
+        else
+            max_blocks = max_same > UINT32_MAX ? UINT32_MAX : (uint32_t)max_same;
+    }
+    while (start <= end)
+    {
+        LBA_t remaining = end - start + 1;
+        uint32_t count = remaining > max_blocks ? max_blocks : remaining;
+        int last = trim_count[pdrv] - 1;
+        if (last >= 0 && trim_ranges[pdrv][last].sector + trim_ranges[pdrv][last].count == start &&
+            trim_ranges[pdrv][last].count + count <= max_blocks)
+        {
+            trim_ranges[pdrv][last].count += count;
+        }
+        else
+        {
+            if (trim_count[pdrv] >= max_ranges)
+            {
+                msc_fat_trim_flush(pdrv);
+                if (!msc_fat_trim_supported(pdrv))
+                    break;
+            }
+            trim_ranges[pdrv][trim_count[pdrv]].sector = start;
+            trim_ranges[pdrv][trim_count[pdrv]].count = count;
+            trim_count[pdrv]++;
+        }
+        start += count;
+    }
+    return RES_OK;
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Write combining                                                       */
+/*-----------------------------------------------------------------------*/
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+// Each drive buffers one run of contiguous sectors. Writes that extend or
+// overwrite the run are merged into it so the drive sees one WRITE10
+// instead of many small ones. The run is written when a write is not
+// adjacent to it, when it is full, when a read touches it, on
+// msc_fat_flush() and when it is older than MSC_FAT_WRITE_COMBINE_TIMEOUT_MS.
+typedef struct {
+    LBA_t sector;       // first sector of the run
+    UINT count;         // number of sectors in the run; 0 if the buffer is empty
+    uint64_t since_us;  // when the run was started
+    bool busy;          // a combiner call on this drive is waiting for a transfer
+} msc_fat_wc_t;
+
+static msc_fat_wc_t wc_run[FF_VOLUMES];
+static_assert(MSC_FAT_WRITE_COMBINE_SECTORS * FF_MIN_SS >= FF_MAX_SS, "the write combining buffer must hold at least one FF_MAX_SS sector");
+
+// Each buffer holds MSC_FAT_WRITE_COMBINE_SECTORS FF_MIN_SS sectors or fewer larger ones
+static BYTE wc_data[FF_VOLUMES][MSC_FAT_WRITE_COMBINE_SECTORS * FF_MIN_SS] __attribute__((aligned(4)));
+
+static bool msc_fat_wc_overlaps(BYTE pdrv, LBA_t sector, UINT count)
+{
+    msc_fat_wc_t* run = &wc_run[pdrv];
+    return run->count != 0 && run->sector < sector + count && sector < run->sector + run->count;
+}
+
+static DRESULT msc_fat_wc_flush_run(BYTE pdrv)
+{
+    msc_fat_wc_t* run = &wc_run[pdrv];
+    DRESULT res = RES_OK;
+    if (run->count != 0)
+    {
+        res = msc_fat_xfer(pdrv, MSC_FAT_OP_WRITE, wc_data[pdrv], run->sector, run->count);
+        run->count = 0; // if the write failed, retrying will not help
+    }
+    return res;
+}
+
+static DRESULT msc_fat_wc_flush(BYTE pdrv)
+{
+    wc_run[pdrv].busy = true;
+    DRESULT res = msc_fat_wc_flush_run(pdrv);
+    wc_run[pdrv].busy = false;
+    return res;
+}
+
+/**
+ * @brief write sectors through the drive's write combining buffer
+ *
+ * Writes at least as large as the buffer that cannot be merged go straight to the drive.
+ */
+static DRESULT msc_fat_wc_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+    msc_fat_wc_t* run = &wc_run[pdrv];
+    UINT max_count = sizeof(wc_data[pdrv]) / sector_size[pdrv];
+    DRESULT res = RES_OK;
+    run->busy = true;
+    if (run->count != 0 && (sector < run->sector || sector > run->sector + run->count ||
+        sector + count - run->sector > max_count))
+    {
+        res = msc_fat_wc_flush_run(pdrv);
+    }
+    if (res == RES_OK)
+    {
+        if (run->count == 0 && count >= max_count)
+        {
+            res = msc_fat_xfer(pdrv, MSC_FAT_OP_WRITE, (BYTE*)buff, sector, count);
+        }
+        else
+        {
+            if (run->count == 0)
+            {
+                run->sector = sector;
+                run->since_us = time_us_64();
+            }
+            memcpy(wc_data[pdrv] + (sector - run->sector) * sector_size[pdrv], buff, count * sector_size[pdrv]);
+            if (sector + count > run->sector + run->count)
+                run->count = sector + count - run->sector;
+            if (run->count == max_count)
+                res = msc_fat_wc_flush_run(pdrv);
+        }
+    }
+    run->busy = false;
+    return res;
+}
+#endif
+
+/**
+ * @brief write sectors to the drive, combining them with adjacent writes if enabled
+ */
+static DRESULT msc_fat_write_sectors(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+    return msc_fat_wc_write(pdrv, buff, sector, count);
+#else
+    return msc_fat_xfer(pdrv, MSC_FAT_OP_WRITE, (BYTE*)buff, sector, count);
+#endif
+}
 
-static msc_fat_xfer_status_t msc_fat_status;
 /*-----------------------------------------------------------------------*/
-/* MSC plug status functions                                             */
+/* Sector cache                                                          */
 /*-----------------------------------------------------------------------*/
-static uint8_t pdrv_to_daddr_map[FF_VOLUMES];
-static uint8_t available_pdrv_bitmap;
+#if MSC_FAT_CACHE_SETS
+// Each drive has its own MSC_FAT_CACHE_SETS x MSC_FAT_CACHE_WAYS set
+// associative cache of single sectors. Sector N lives in set
+// N % MSC_FAT_CACHE_SETS so runs of FAT or directory sectors spread
+// across the sets. Writes of single sectors stay in the cache until the
+// line is evicted or the drive is flushed; multi-sector transfers go
+// straight to the drive and keep the cache coherent.
+//
+// The lines are sized for FF_MIN_SS sectors. A drive with larger sectors
+// gets fewer sets, then fewer ways, so its cache takes the same memory.
+typedef struct {
+    LBA_t sector;
+    uint32_t last_used; // value of the drive's cache_clock when the line was last accessed
+    bool valid;
+    bool dirty;
+} msc_fat_cache_tag_t;
+
+static msc_fat_cache_tag_t cache_tag[FF_VOLUMES][MSC_FAT_CACHE_SETS][MSC_FAT_CACHE_WAYS];
+static BYTE cache_data[FF_VOLUMES][MSC_FAT_CACHE_SETS * MSC_FAT_CACHE_WAYS * FF_MIN_SS] __attribute__((aligned(4)));
+static uint8_t cache_sets[FF_VOLUMES];
+static uint8_t cache_ways[FF_VOLUMES];
+static uint32_t cache_clock[FF_VOLUMES];
+
+static_assert(MSC_FAT_CACHE_SETS * MSC_FAT_CACHE_WAYS * FF_MIN_SS >= FF_MAX_SS, "the sector cache must hold at least one FF_MAX_SS sector");
+
+static void msc_fat_cache_invalidate(BYTE pdrv)
+{
+    memset(cache_tag[pdrv], 0, sizeof(cache_tag[pdrv]));
+}
+
+static bool msc_fat_cache_is_dirty(BYTE pdrv)
+{
+    for (int set_idx = 0; set_idx < MSC_FAT_CACHE_SETS; set_idx++)
+    {
+        for (int way = 0; way < MSC_FAT_CACHE_WAYS; way++)
+        {
+            if (cache_tag[pdrv][set_idx][way].valid && cache_tag[pdrv][set_idx][way].dirty)
+                return true;
+        }
+    }
+    return false;
+}
 
 /**
- * @brief convert the physical drive number to a USB device address
- *
- * @param pdrv the physical drive number 0-(FF_VOLUMES-1)
- * @return uint8_t the USB device address of the drive or 0 if pdrv is no present
+ * @brief empty the drive's cache and size its sets and ways for the drive's sector size
  */
-uint8_t msc_pdrv_to_daddr(uint8_t pdrv)
+static void msc_fat_cache_init(BYTE pdrv)
 {
-    return pdrv_to_daddr_map[pdrv];
+    msc_fat_cache_invalidate(pdrv);
+    UINT lines = sizeof(cache_data[pdrv]) / sector_size[pdrv];
+    cache_ways[pdrv] = lines < MSC_FAT_CACHE_WAYS ? lines : MSC_FAT_CACHE_WAYS;
+    cache_sets[pdrv] = lines / cache_ways[pdrv];
 }
 
+static BYTE* msc_fat_cache_line(BYTE pdrv, uint32_t set_idx, int way)
+{
+    return cache_data[pdrv] + (set_idx * MSC_FAT_CACHE_WAYS + way) * sector_size[pdrv];
+}
 
 /**
- * @brief convert a USB device address to a physical drive number
+ * @brief find the way of the sector's set that holds the sector
  *
- * @param daddr USB device address
- * @return uint8_t the physical drive number or FF_VOLUMES if daddr is not a drive
+ * @return int the way number or -1 on a cache miss
  */
-uint8_t msc_daddr_to_pdrv(uint8_t daddr)
+static int msc_fat_cache_lookup(BYTE pdrv, LBA_t sector)
 {
-    uint8_t pdrv = FF_VOLUMES;
-    for (size_t idx = 0; idx < sizeof(pdrv_to_daddr_map); idx++)
+    msc_fat_cache_tag_t* set = cache_tag[pdrv][sector % cache_sets[pdrv]];
+    for (int way = 0; way < cache_ways[pdrv]; way++)
     {
-        if (pdrv_to_daddr_map[idx] == daddr)
+        if (set[way].valid && set[way].sector == sector)
         {
-            pdrv = idx;
+            set[way].last_used = ++cache_clock[pdrv];
+            return way;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief claim a line for the sector, writing back the least recently used line if it is dirty
+ *
+ * The returned line is tagged with the sector but is not valid yet.
+ *
+ * @return int the way number or -1 if writing back the evicted line failed
+ */
+static int msc_fat_cache_alloc(BYTE pdrv, LBA_t sector)
+{
+    uint32_t set_idx = sector % cache_sets[pdrv];
+    msc_fat_cache_tag_t* set = cache_tag[pdrv][set_idx];
+    int victim = 0;
+    for (int way = 0; way < cache_ways[pdrv]; way++)
+    {
+        if (!set[way].valid)
+        {
+            victim = way;
             break;
         }
+        if (set[way].last_used < set[victim].last_used)
+            victim = way;
     }
-    return pdrv;
+    if (set[victim].valid && set[victim].dirty)
+    {
+        if (msc_fat_write_sectors(pdrv, msc_fat_cache_line(pdrv, set_idx, victim), set[victim].sector, 1) != RES_OK)
+            return -1;
+    }
+    set[victim].valid = false;
+    set[victim].dirty = false;
+    set[victim].sector = sector;
+    set[victim].last_used = ++cache_clock[pdrv];
+    return victim;
 }
 
-uint8_t msc_map_next_pdrv(uint8_t daddr)
+static DRESULT msc_fat_cache_read(BYTE pdrv, BYTE* buff, LBA_t sector)
 {
-    uint8_t next_drive_plus_1 = __builtin_ffs(available_pdrv_bitmap);
-    assert(next_drive_plus_1 != 0 && next_drive_plus_1 <= FF_VOLUMES);
-    uint8_t pdrv = next_drive_plus_1 - 1;
-    available_pdrv_bitmap &= ~(1 << pdrv); // clear the available drive bit
-    pdrv_to_daddr_map[pdrv] = daddr;
-    return pdrv;
+    uint32_t set_idx = sector % cache_sets[pdrv];
+    int way = msc_fat_cache_lookup(pdrv, sector);
+    if (way < 0)
+    {
+        way = msc_fat_cache_alloc(pdrv, sector);
+        if (way < 0)
+            return RES_ERROR;
+        DRESULT res = msc_fat_xfer(pdrv, MSC_FAT_OP_READ, msc_fat_cache_line(pdrv, set_idx, way), sector, 1);
+        if (res != RES_OK)
+            return res;
+        cache_tag[pdrv][set_idx][way].valid = true;
+    }
+    memcpy(buff, msc_fat_cache_line(pdrv, set_idx, way), sector_size[pdrv]);
+    return RES_OK;
 }
 
-uint8_t msc_unmap_pdrv(uint8_t daddr)
+static DRESULT msc_fat_cache_write(BYTE pdrv, const BYTE* buff, LBA_t sector)
 {
-    assert(daddr <= FF_VOLUMES);
-    uint8_t pdrv = msc_daddr_to_pdrv(daddr);
-    if (pdrv < FF_VOLUMES)
+    uint32_t set_idx = sector % cache_sets[pdrv];
+    int way = msc_fat_cache_lookup(pdrv, sector);
+    if (way < 0)
     {
-        available_pdrv_bitmap |= (1 << pdrv); // set the available drive bit
-        pdrv_to_daddr_map[daddr] = 0;
+        way = msc_fat_cache_alloc(pdrv, sector);
+        if (way < 0)
+            return RES_ERROR;
+    }
+    memcpy(msc_fat_cache_line(pdrv, set_idx, way), buff, sector_size[pdrv]);
+    cache_tag[pdrv][set_idx][way].valid = true;
+    cache_tag[pdrv][set_idx][way].dirty = true;
+    return RES_OK;
+}
+
+/**
+ * @brief make sectors read directly from the drive reflect the dirty lines in the cache
+ */
+static void msc_fat_cache_merge_dirty(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+    for (int set_idx = 0; set_idx < cache_sets[pdrv]; set_idx++)
+    {
+        for (int way = 0; way < cache_ways[pdrv]; way++)
+        {
+            msc_fat_cache_tag_t* tag = &cache_tag[pdrv][set_idx][way];
+            if (tag->valid && tag->dirty && tag->sector >= sector && tag->sector - sector < count)
+                memcpy(buff + (tag->sector - sector) * sector_size[pdrv], msc_fat_cache_line(pdrv, set_idx, way), sector_size[pdrv]);
+        }
+    }
+}
+
+/**
+ * @brief update the cached copies of sectors written directly to the drive
+ */
+static void msc_fat_cache_update_clean(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+    for (int set_idx = 0; set_idx < cache_sets[pdrv]; set_idx++)
+    {
+        for (int way = 0; way < cache_ways[pdrv]; way++)
+        {
+            msc_fat_cache_tag_t* tag = &cache_tag[pdrv][set_idx][way];
+            if (tag->valid && tag->sector >= sector && tag->sector - sector < count)
+            {
+                memcpy(msc_fat_cache_line(pdrv, set_idx, way), buff + (tag->sector - sector) * sector_size[pdrv], sector_size[pdrv]);
+                tag->dirty = false;
+            }
+        }
+    }
+}
+
+/**
+ * @brief drop the cached copies of sectors, dirty or not
+ */
+static void msc_fat_cache_discard(BYTE pdrv, LBA_t sector, UINT count)
+{
+    for (int set_idx = 0; set_idx < cache_sets[pdrv]; set_idx++)
+    {
+        for (int way = 0; way < cache_ways[pdrv]; way++)
+        {
+            msc_fat_cache_tag_t* tag = &cache_tag[pdrv][set_idx][way];
+            if (tag->valid && tag->sector >= sector && tag->sector - sector < count)
+            {
+                tag->valid = false;
+                tag->dirty = false;
+            }
+        }
+    }
+}
+
+/**
+ * @brief write the dirty lines back in ascending sector order so adjacent lines can be combined
+ */
+static DRESULT msc_fat_cache_flush(BYTE pdrv)
+{
+    DRESULT res = RES_OK;
+    for (;;)
+    {
+        msc_fat_cache_tag_t* oldest = NULL;
+        BYTE* data = NULL;
+        for (int set_idx = 0; set_idx < cache_sets[pdrv]; set_idx++)
+        {
+            for (int way = 0; way < cache_ways[pdrv]; way++)
+            {
+                msc_fat_cache_tag_t* tag = &cache_tag[pdrv][set_idx][way];
+                if (tag->valid && tag->dirty && (oldest == NULL || tag->sector < oldest->sector))
+                {
+                    oldest = tag;
+                    data = msc_fat_cache_line(pdrv, set_idx, way);
+                }
+            }
+        }
+        if (oldest == NULL)
+            break;
+        oldest->dirty = false; // if the write fails, do not try it again
+        if (msc_fat_write_sectors(pdrv, data, oldest->sector, 1) != RES_OK)
+            res = RES_ERROR;
+    }
+    return res;
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Asynchronous writes                                                   */
+/*-----------------------------------------------------------------------*/
+/**
+ * @brief keep the caches coherent with sectors about to be written around them
+ *
+ * Combined and trimmed sectors in the range are sent first so they cannot
+ * land after the new data; cached and read-ahead copies are dropped.
+ */
+static void msc_fat_forget(BYTE pdrv, LBA_t sector, UINT count)
+{
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+    if (msc_fat_wc_overlaps(pdrv, sector, count))
+        msc_fat_wc_flush(pdrv);
+#endif
+#if MSC_FAT_TRIM_RANGES
+    if (msc_fat_trim_overlaps(pdrv, sector, count))
+        msc_fat_trim_flush(pdrv);
+#endif
+#if MSC_FAT_READAHEAD_BUFFERS
+    msc_fat_shared_enter();
+    msc_fat_ra_invalidate(pdrv, sector, count);
+    msc_fat_shared_exit();
+#endif
+#if MSC_FAT_CACHE_SETS
+    msc_fat_cache_discard(pdrv, sector, count);
+#endif
+}
+
+bool msc_fat_write_async(msc_fat_io_t* io, BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg)
+{
+    if (pdrv >= FF_VOLUMES || (disk_state[pdrv] & (STA_NODISK | STA_NOINIT)))
+        return false;
+    msc_fat_lock(pdrv);
+    msc_fat_forget(pdrv, sector, count);
+    bool queued = msc_fat_submit_op(io, MSC_FAT_OP_WRITE, pdrv, (BYTE*)buff, sector, count, complete_cb, user_arg);
+    msc_fat_unlock(pdrv);
+    return queued;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Drive write cache synchronization                                     */
+/*-----------------------------------------------------------------------*/
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+
+typedef struct {
+    msc_fat_io_t io;        // the deferred SYNCHRONIZE CACHE request
+    msc_cbw_t cbw;
+    uint64_t due_us;        // when msc_fat_task() should issue the deferred command
+    bool pending;           // a CTRL_SYNC is waiting for a deferred command
+    bool in_flight;         // the deferred command is queued
+    bool unsupported;       // the drive rejected SYNCHRONIZE CACHE; do not send it again
+} msc_fat_sync_state_t;
+
+static msc_fat_sync_state_t sync_state[FF_VOLUMES];
+
+static void msc_fat_sync_cbw_init(msc_cbw_t* cbw)
+{
+    msc_fat_cbw_init(cbw, 10, 0, false);
+    cbw->command[0] = SCSI_CMD_SYNCHRONIZE_CACHE_10; // LBA 0 and 0 blocks means the whole medium
+}
+
+/**
+ * @brief make the drive commit its write cache to the medium
+ *
+ * Drives that do not implement SYNCHRONIZE CACHE fail it once and are not asked again.
+ */
+static DRESULT msc_fat_sync_cache(BYTE pdrv)
+{
+    if (sync_state[pdrv].unsupported)
+        return RES_OK;
+    msc_cbw_t cbw;
+    msc_fat_sync_cbw_init(&cbw);
+    if (msc_fat_scsi(pdrv, &cbw, NULL) != RES_OK)
+        sync_state[pdrv].unsupported = true; // most drives without it are write-through anyway
+    sync_state[pdrv].pending = false;
+    return RES_OK;
+}
+
+static void msc_fat_sync_deferred_cb(msc_fat_io_t* io)
+{
+    msc_fat_sync_state_t* state = &sync_state[io->pdrv];
+    if (io->status != MSC_FAT_COMPLETE)
+        state->unsupported = true;
+    state->in_flight = false;
+}
+
+/**
+ * @brief issue the drive's deferred SYNCHRONIZE CACHE command if it is due
+ */
+static void msc_fat_sync_task(BYTE pdrv, uint64_t now)
+{
+    msc_fat_sync_state_t* state = &sync_state[pdrv];
+    if (!state->pending || state->in_flight || now < state->due_us)
+        return;
+    state->pending = false;
+    if (state->unsupported)
+        return;
+    msc_fat_sync_cbw_init(&state->cbw);
+    state->in_flight = msc_fat_scsi_async(&state->io, pdrv, &state->cbw, NULL, msc_fat_sync_deferred_cb, 0);
+}
+
+DRESULT msc_fat_flush(BYTE pdrv)
+{
+    if (pdrv >= FF_VOLUMES)
+        return RES_PARERR;
+    if (disk_state[pdrv] & (STA_NODISK | STA_NOINIT))
+        return RES_NOTRDY;
+    DRESULT res = RES_OK;
+    msc_fat_lock(pdrv);
+#if MSC_FAT_TRIM_RANGES
+    msc_fat_trim_flush(pdrv);
+#endif
+#if MSC_FAT_CACHE_SETS
+    res = msc_fat_cache_flush(pdrv);
+#endif
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+    if (msc_fat_wc_flush(pdrv) != RES_OK)
+        res = RES_ERROR;
+#endif
+    msc_fat_unlock(pdrv);
+    return res;
+}
+
+DRESULT msc_fat_sync(BYTE pdrv)
+{
+    DRESULT res = msc_fat_flush(pdrv);
+    if (res == RES_OK)
+    {
+        msc_fat_lock(pdrv);
+        res = msc_fat_sync_cache(pdrv);
+        msc_fat_unlock(pdrv);
+    }
+    return res;
+}
+
+/**
+ * @brief write the cached sectors and commit the drive's write cache now or
+ * after MSC_FAT_SYNC_DELAY_MS, so a burst of f_sync() calls costs one command
+ */
+static DRESULT msc_fat_ctrl_sync(BYTE pdrv)
+{
+#if MSC_FAT_SYNC_DELAY_MS
+    DRESULT res = msc_fat_flush(pdrv);
+    msc_fat_sync_state_t* state = &sync_state[pdrv];
+    if (res == RES_OK && !state->pending)
+    {
+        state->due_us = time_us_64() + MSC_FAT_SYNC_DELAY_MS * 1000ull;
+        state->pending = true;
+    }
+    return res;
+#else
+    return msc_fat_sync(pdrv);
+#endif
+}
+
+/**
+ * @brief discard what is cached for an unplugged drive; the caller holds
+ * the drive lock and no caller further up the stack is using the drive
+ */
+static void msc_fat_drop(BYTE pdrv)
+{
+    bool lost = false;
+#if MSC_FAT_CACHE_SETS
+    lost = msc_fat_cache_is_dirty(pdrv);
+    msc_fat_cache_invalidate(pdrv); // whatever was not flushed is lost with the drive
+#endif
+#if MSC_FAT_READAHEAD_BUFFERS
+    msc_fat_shared_enter();
+    msc_fat_ra_discard(pdrv);
+    msc_fat_shared_exit();
+#endif
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+    lost |= wc_run[pdrv].count != 0;
+    wc_run[pdrv].count = 0;
+#endif
+#if MSC_FAT_TRIM_RANGES
+    trim_count[pdrv] = 0;
+#endif
+    memset(&sync_state[pdrv], 0, sizeof(sync_state[pdrv]));
+    if (lost)
+        MSC_FAT_STORE(writes_lost[pdrv], true);
+    MSC_FAT_STORE(unplug_pending[pdrv], false);
+}
+
+void msc_fat_task()
+{
+    uint64_t now = time_us_64();
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
+    {
+        if (!recursive_mutex_try_enter(&drive_lock[pdrv], NULL))
+            continue; // the other core is using the drive; try again next time
+        if (MSC_FAT_LOAD(unplug_pending[pdrv]))
+            msc_fat_drop(pdrv);
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+        msc_fat_wc_t* run = &wc_run[pdrv];
+        if (!run->busy && run->count != 0 && now - run->since_us >= MSC_FAT_WRITE_COMBINE_TIMEOUT_MS * 1000ull)
+            msc_fat_wc_flush(pdrv);
+#endif
+        if ((disk_state[pdrv] & (STA_NODISK | STA_NOINIT)) == 0)
+            msc_fat_sync_task(pdrv, now);
+        msc_fat_unlock(pdrv);
     }
-    return pdrv;
 }
 
 void msc_fat_unplug(
     BYTE pdrv /* Physical drive nmuber to identify the drive */
 )
 {
-    if (pdrv < CFG_TUH_DEVICE_MAX)
+    if (pdrv < FF_VOLUMES)
+    {
         disk_state[pdrv] |= STA_NOINIT | STA_NODISK;
-    ;
+        MSC_FAT_STORE(unplug_pending[pdrv], true);
+        // Fail whatever the holder of the drive lock is waiting for so it lets go
+        msc_fat_abort_queue(pdrv);
+        // This may run in a tinyusb callback, so do not wait for the lock.
+        // If another core holds it, or this core holds it further up the
+        // stack, msc_fat_task() or disk_initialize() drops the state later.
+        if (recursive_mutex_try_enter(&drive_lock[pdrv], NULL))
+        {
+            if (drive_lock[pdrv].enter_count == 1)
+                msc_fat_drop(pdrv);
+            msc_fat_unlock(pdrv);
+        }
+    }
 }
 
+bool msc_fat_writes_lost(
+    BYTE pdrv /* Physical drive nmuber to identify the drive */
+)
+{
+    if (pdrv >= FF_VOLUMES || !MSC_FAT_LOAD(writes_lost[pdrv]))
+        return false;
+    MSC_FAT_STORE(writes_lost[pdrv], false);
+    return true;
+}
 void msc_fat_plug_in(
     BYTE pdrv /* Physical drive nmuber to identify the drive */
 )
 {
-    if (pdrv < CFG_TUH_DEVICE_MAX)
+    if (pdrv < FF_VOLUMES)
         disk_state[pdrv] &= ~STA_NODISK;
 }
 
@@ -128,7 +1547,7 @@ bool msc_fat_is_plugged_in(
 )
 {
     bool plugged_in = false;
-    if (pdrv < CFG_TUH_DEVICE_MAX)
+    if (pdrv < FF_VOLUMES)
     {
         plugged_in = (disk_state[pdrv] & STA_NODISK) == 0;
     }
@@ -137,48 +1556,62 @@ bool msc_fat_is_plugged_in(
 
 void msc_fat_init()
 {
-    mutex_init(&msc_fat_mutex);
-    msc_fat_status = MSC_FAT_ERROR;
-    for (int pdrv = 0; pdrv < CFG_TUH_DEVICE_MAX; pdrv++)
+    recursive_mutex_init(&shared_lock);
+    for (int pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
+        recursive_mutex_init(&drive_lock[pdrv]);
+    for (int pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
+    {
         msc_fat_unplug(pdrv); // assume no drives are plugged int
+        xfer_status[pdrv] = MSC_FAT_ERROR;
+    }
     available_pdrv_bitmap = (1 << FF_VOLUMES) - 1;
     memset(pdrv_to_daddr_map, 0, sizeof(pdrv_to_daddr_map));
+    memset(io_queue, 0, sizeof(io_queue));
 }
 
-void msc_fat_set_status(msc_fat_xfer_status_t stat)
+void msc_fat_set_status(uint8_t dev_addr, msc_fat_xfer_status_t stat)
 {
-    mutex_enter_blocking(&msc_fat_mutex);
-    msc_fat_status = stat;
-    mutex_exit(&msc_fat_mutex);
+    uint8_t pdrv = msc_daddr_to_pdrv(dev_addr);
+    if (pdrv < FF_VOLUMES)
+    {
+        MSC_FAT_STORE(xfer_status[pdrv], stat);
+        if (stat != MSC_FAT_IN_PROGRESS)
+            __sev();
+    }
 }
 
-msc_fat_xfer_status_t msc_fat_get_xfer_status()
+msc_fat_xfer_status_t msc_fat_get_xfer_status(uint8_t dev_addr)
 {
-    mutex_enter_blocking(&msc_fat_mutex);
-    msc_fat_xfer_status_t res = msc_fat_status;
-    mutex_exit(&msc_fat_mutex);
+    msc_fat_xfer_status_t res = MSC_FAT_ERROR;
+    uint8_t pdrv = msc_daddr_to_pdrv(dev_addr);
+    if (pdrv < FF_VOLUMES)
+    {
+        msc_fat_queue_t* q = &io_queue[pdrv];
+        if (MSC_FAT_LOAD(q->sq_head) != MSC_FAT_LOAD(q->sq_tail))
+            res = MSC_FAT_IN_PROGRESS;
+        else
+            res = MSC_FAT_LOAD(xfer_status[pdrv]);
+    }
     return res;
 }
 
-void msc_fat_wait_transfer_complete()
+void msc_fat_wait_transfer_complete(uint8_t dev_addr)
 {
-    while (msc_fat_get_xfer_status() == MSC_FAT_IN_PROGRESS)
+    while (msc_fat_get_xfer_status(dev_addr) == MSC_FAT_IN_PROGRESS)
     {
-        main_loop_task();
+        msc_fat_wait_event();
     }
 }
 
 bool msc_fat_complete_cb(uint8_t dev_addr, tuh_msc_complete_data_t const* cb_data)
 {
-    // TODO does the msc_fat_status have to be address dependent?
-    (void)dev_addr;
     if (cb_data->csw->status == MSC_CSW_STATUS_PASSED)
     {
-        msc_fat_set_status(MSC_FAT_COMPLETE);
+        msc_fat_set_status(dev_addr, MSC_FAT_COMPLETE);
     }
     else
     {
-        msc_fat_set_status(MSC_FAT_ERROR);
+        msc_fat_set_status(dev_addr, MSC_FAT_ERROR);
     }
     return cb_data->csw->status == MSC_CSW_STATUS_PASSED;
 }
@@ -191,7 +1624,7 @@ DSTATUS disk_status(
     BYTE pdrv /* Physical drive nmuber to identify the drive */
 )
 {
-    if (pdrv >= CFG_TUH_DEVICE_MAX)
+    if (pdrv >= FF_VOLUMES)
         return STA_NOINIT | STA_NODISK;
     return disk_state[pdrv];
 }
@@ -205,14 +1638,34 @@ DSTATUS disk_initialize(
 )
 {
     DSTATUS stat = STA_NOINIT;
-    if (pdrv < CFG_TUH_DEVICE_MAX)
+    if (pdrv < FF_VOLUMES)
     {
-        if ((disk_state[pdrv] & STA_NODISK) == 0)
+        msc_fat_lock(pdrv);
+        if (MSC_FAT_LOAD(unplug_pending[pdrv]))
+            msc_fat_drop(pdrv); // the drive was unplugged and plugged in before msc_fat_task() ran
+        if (disk_state[pdrv] == 0)
+        {
+            // Already up; starting over would discard the dirty cached
+            // sectors and probe the drive again
+            msc_fat_unlock(pdrv);
+            return 0;
+        }
+        uint32_t block_size = tuh_msc_get_block_size(msc_pdrv_to_daddr(pdrv), 0);
+        bool supported = block_size >= FF_MIN_SS && block_size <= FF_MAX_SS && (block_size & (block_size - 1)) == 0;
+        if ((disk_state[pdrv] & STA_NODISK) == 0 && supported)
         {
+            sector_size[pdrv] = block_size;
+#if MSC_FAT_CACHE_SETS
+            msc_fat_cache_init(pdrv);
+#endif
             disk_state[pdrv] = 0;
             stat = 0;
-            msc_fat_set_status(MSC_FAT_COMPLETE);
+            msc_fat_set_status(msc_pdrv_to_daddr(pdrv), MSC_FAT_COMPLETE);
+            msc_fat_read_limits(pdrv);
+            msc_fat_read_capacity(pdrv);
+            msc_fat_probe_erase_block(pdrv);
         }
+        msc_fat_unlock(pdrv);
     }
 
     return stat;
@@ -222,6 +1675,46 @@ DSTATUS disk_initialize(
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
+static DRESULT msc_fat_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+    DRESULT res = RES_OK;
+    BYTE* dst = buff;
+    LBA_t next = sector;
+    UINT remaining = count;
+#if MSC_FAT_WRITE_COMBINE_SECTORS
+    if (msc_fat_wc_overlaps(pdrv, sector, count))
+    {
+        res = msc_fat_wc_flush(pdrv); // it also marks stale read-ahead data
+        if (res != RES_OK)
+            return res;
+    }
+#endif
+#if MSC_FAT_READAHEAD_BUFFERS
+#if MSC_FAT_CACHE_SETS
+    if (count != 1 || msc_fat_cache_lookup(pdrv, sector) < 0) // a cached sector may be newer
+#endif
+        msc_fat_ra_take(pdrv, &dst, &next, &remaining);
+#endif
+    if (remaining != 0)
+    {
+#if MSC_FAT_CACHE_SETS
+        if (remaining == 1)
+            res = msc_fat_cache_read(pdrv, dst, next);
+        else
+#endif
+            res = msc_fat_xfer(pdrv, MSC_FAT_OP_READ, dst, next, remaining);
+    }
+#if MSC_FAT_CACHE_SETS
+    if (res == RES_OK && count != 1)
+        msc_fat_cache_merge_dirty(pdrv, buff, sector, count);
+#endif
+#if MSC_FAT_READAHEAD_BUFFERS
+    if (res == RES_OK)
+        msc_fat_ra_track(pdrv, sector, count);
+#endif
+    return res;
+}
+
 DRESULT disk_read(
     BYTE pdrv,    /* Physical drive nmuber to identify the drive */
     BYTE *buff,   /* Data buffer to store read data */
@@ -230,7 +1723,7 @@ DRESULT disk_read(
 )
 {
     DRESULT res = RES_PARERR;
-    if (pdrv < CFG_TUH_DEVICE_MAX && buff != NULL)
+    if (pdrv < FF_VOLUMES && buff != NULL)
     {
         if (disk_state[pdrv] & (STA_NODISK | STA_NOINIT))
         {
@@ -238,25 +1731,9 @@ DRESULT disk_read(
         }
         else
         {
-            assert(msc_fat_get_xfer_status() == MSC_FAT_COMPLETE);
-            uint8_t dev_addr = msc_pdrv_to_daddr(pdrv);
-            msc_fat_set_status(MSC_FAT_IN_PROGRESS);
-            if (!tuh_msc_read10(dev_addr, 0, buff, sector, count, msc_fat_complete_cb, 0))
-            {
-                res = RES_ERROR;
-            }
-            else
-            {
-                msc_fat_wait_transfer_complete();
-                if (msc_fat_get_xfer_status() == MSC_FAT_ERROR)
-                {
-                    res = RES_ERROR;
-                }
-                else
-                {
-                    res = RES_OK;
-                }
-            }
+            msc_fat_lock(pdrv);
+            res = msc_fat_read(pdrv, buff, sector, count);
+            msc_fat_unlock(pdrv);
         }
     }
     return res;
@@ -276,7 +1753,7 @@ DRESULT disk_write(
 )
 {
     DRESULT res = RES_PARERR;
-    if (pdrv < CFG_TUH_DEVICE_MAX && buff != NULL)
+    if (pdrv < FF_VOLUMES && buff != NULL)
     {
         if (disk_state[pdrv] & (STA_NODISK | STA_NOINIT))
         {
@@ -284,25 +1761,22 @@ DRESULT disk_write(
         }
         else
         {
-            assert(msc_fat_get_xfer_status() == MSC_FAT_COMPLETE);
-            uint8_t dev_addr = msc_pdrv_to_daddr(pdrv);
-            msc_fat_set_status(MSC_FAT_IN_PROGRESS);
-            if (!tuh_msc_write10(dev_addr, 0, buff, sector, count, msc_fat_complete_cb, 0))
+            msc_fat_lock(pdrv);
+#if MSC_FAT_CACHE_SETS
+            if (count == 1)
             {
-                res = RES_ERROR;
+                res = msc_fat_cache_write(pdrv, buff, sector);
             }
             else
             {
-                msc_fat_wait_transfer_complete();
-                if (msc_fat_get_xfer_status() == MSC_FAT_ERROR)
-                {
-                    res = RES_ERROR;
-                }
-                else
-                {
-                    res = RES_OK;
-                }
+                res = msc_fat_write_sectors(pdrv, buff, sector, count);
+                if (res == RES_OK)
+                    msc_fat_cache_update_clean(pdrv, buff, sector, count);
             }
+#else
+            res = msc_fat_write_sectors(pdrv, buff, sector, count);
+#endif
+            msc_fat_unlock(pdrv);
         }
     }
     return res;
@@ -320,41 +1794,54 @@ DRESULT disk_ioctl(
     void *buff /* Buffer to send/receive control data */
 )
 {
-    (void)buff;
-    (void)pdrv;
     DRESULT res = RES_OK;
-    if (disk_state[pdrv] != 0)
+    if (pdrv >= FF_VOLUMES)
+    {
+        res = RES_PARERR;
+    }
+    else if (disk_state[pdrv] != 0)
     {
         res = RES_ERROR; // not mounted
     }
     else
     {
+        msc_fat_lock(pdrv);
         switch (cmd)
         {
         case CTRL_SYNC:
+            res = msc_fat_ctrl_sync(pdrv);
             break;
+#if MSC_FAT_TRIM_RANGES
+        case CTRL_TRIM:
+        {
+            LBA_t *range = (LBA_t *)buff;
+            res = msc_fat_trim(pdrv, range[0], range[1]);
+        }
+        break;
+#endif
         case GET_SECTOR_COUNT:
         {
             LBA_t *ptr = (LBA_t *)buff;
-            *ptr = tuh_msc_get_block_count(pdrv + 1, 0);
+            *ptr = drive_limits[pdrv].block_count;
         }
         break;
         case GET_SECTOR_SIZE:
         {
             WORD *ptr = (WORD *)buff;
-            *ptr = tuh_msc_get_block_size(pdrv + 1, 0);
+            *ptr = sector_size[pdrv];
         }
         break;
         case GET_BLOCK_SIZE:
         {
             DWORD *ptr = (DWORD *)buff;
-            *ptr = 1; // unknown
+            *ptr = drive_limits[pdrv].erase_block;
         }
         break;
         default:
             res = RES_ERROR;
             break;
         }
+        msc_fat_unlock(pdrv);
     }
     return res;
 }
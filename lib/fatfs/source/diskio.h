@@ -5,6 +5,7 @@
 #ifndef _DISKIO_DEFINED
 #define _DISKIO_DEFINED
 #include "tusb.h"
+#include "pico/mutex.h"
 #ifdef __cplusplus
 extern "C" {
 #else
@@ -75,16 +76,135 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 /* Helper functions for managing USB FAT drives in tinyusb */
 typedef enum {MSC_FAT_IN_PROGRESS, MSC_FAT_COMPLETE, MSC_FAT_ERROR} msc_fat_xfer_status_t;
 
+/* Asynchronous, queued block I/O */
+#ifndef MSC_FAT_QUEUE_DEPTH
+#define MSC_FAT_QUEUE_DEPTH 8	/* Requests that may be queued per drive (power of 2, 128 max) */
+#endif
+
+/* The core that runs tuh_task(); only it issues commands to the drives */
+#ifndef MSC_FAT_USB_CORE
+#if defined(CFG_TUH_RPI_PIO_USB) && CFG_TUH_RPI_PIO_USB
+#define MSC_FAT_USB_CORE 1
+#else
+#define MSC_FAT_USB_CORE 0
+#endif
+#endif
+
+/* Write-back sector cache; each drive gets MSC_FAT_CACHE_SETS * MSC_FAT_CACHE_WAYS * FF_MIN_SS bytes */
+#ifndef MSC_FAT_CACHE_SETS
+#define MSC_FAT_CACHE_SETS 4	/* Sets per drive (0:Disable the cache); drives with larger sectors get fewer */
+#endif
+#ifndef MSC_FAT_CACHE_WAYS
+#define MSC_FAT_CACHE_WAYS 2	/* Lines per set */
+#endif
+
+/* Sequential read-ahead; the pool takes MSC_FAT_READAHEAD_BUFFERS * MSC_FAT_READAHEAD_SECTORS * FF_MIN_SS bytes */
+#ifndef MSC_FAT_READAHEAD_BUFFERS
+#define MSC_FAT_READAHEAD_BUFFERS 4	/* Buffers shared by all drives (0:Disable read-ahead) */
+#endif
+#ifndef MSC_FAT_READAHEAD_SECTORS
+#define MSC_FAT_READAHEAD_SECTORS 8	/* FF_MIN_SS sectors read ahead per buffer */
+#endif
+
+/* Write combining; each drive gets a MSC_FAT_WRITE_COMBINE_SECTORS * FF_MIN_SS byte buffer */
+#ifndef MSC_FAT_WRITE_COMBINE_SECTORS
+#define MSC_FAT_WRITE_COMBINE_SECTORS 8	/* Most FF_MIN_SS sectors merged into one WRITE10 (0:Disable write combining) */
+#endif
+#ifndef MSC_FAT_WRITE_COMBINE_TIMEOUT_MS
+#define MSC_FAT_WRITE_COMBINE_TIMEOUT_MS 100	/* Longest time msc_fat_task() leaves combined sectors unwritten */
+#endif
+
+/* SYNCHRONIZE CACHE batching for disk_ioctl(CTRL_SYNC) */
+#ifndef MSC_FAT_SYNC_DELAY_MS
+#define MSC_FAT_SYNC_DELAY_MS 0	/* 0:CTRL_SYNC waits for the drive to commit its write cache, >0:msc_fat_task() issues one SYNCHRONIZE CACHE this long after the first CTRL_SYNC of a burst */
+#endif
+
+/* Trim (SCSI UNMAP) batching */
+#ifndef MSC_FAT_TRIM_RANGES
+#define MSC_FAT_TRIM_RANGES 16	/* Trimmed ranges collected per drive before an UNMAP is sent (0:Ignore CTRL_TRIM) */
+#endif
+#ifndef MSC_FAT_WRITE_SAME_BLOCKS
+#define MSC_FAT_WRITE_SAME_BLOCKS 2048	/* Most blocks per WRITE SAME(16) trim if the drive reports no MAXIMUM WRITE SAME LENGTH */
+#endif
+
+typedef enum {MSC_FAT_OP_READ, MSC_FAT_OP_WRITE, MSC_FAT_OP_SCSI} msc_fat_op_t;
+
+/**
+ * @brief what the drive reported in its Block Limits and Logical Block
+ * Provisioning VPD pages; 0 means not reported. block_count and
+ * erase_block are always set; erase_block is guessed when the drive does
+ * not report a granularity.
+ */
+typedef struct {
+    uint32_t max_xfer_blocks;       // MAXIMUM TRANSFER LENGTH
+    uint32_t opt_xfer_gran;         // OPTIMAL TRANSFER LENGTH GRANULARITY
+    uint32_t max_unmap_blocks;      // MAXIMUM UNMAP LBA COUNT
+    uint32_t max_unmap_ranges;      // MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT
+    uint32_t unmap_gran;            // OPTIMAL UNMAP GRANULARITY
+    uint64_t max_write_same_blocks; // MAXIMUM WRITE SAME LENGTH
+    bool unmap;                     // LBPU: UNMAP is supported
+    bool write_same_unmap;          // LBPWS: WRITE SAME(16) with the UNMAP bit is supported
+    uint32_t erase_block;           // erase block size in sectors reported by GET_BLOCK_SIZE
+    uint64_t block_count;           // READ CAPACITY(16) result if READ CAPACITY(10) overflowed
+} msc_fat_limits_t;
+
+typedef struct msc_fat_io_s msc_fat_io_t;
+
+/**
+ * @brief callback when a queued request is complete
+ *
+ * It is called from the USB host task context, so it must not block.
+ * It may submit more requests.
+ *
+ * @param io the completed request; io->status is MSC_FAT_COMPLETE or MSC_FAT_ERROR
+ */
+typedef void (*msc_fat_io_cb_t)(msc_fat_io_t* io);
+
+/**
+ * @brief one queued read, write or SCSI command request
+ *
+ * The request, its buffer and its CBW are owned by the caller and must
+ * stay valid until the request completes.
+ */
+struct msc_fat_io_s {
+    msc_fat_op_t op;
+    BYTE pdrv;
+    BYTE* buff;                     // for MSC_FAT_OP_SCSI, the data stage buffer or NULL
+    LBA_t sector;
+    UINT count;
+    const msc_cbw_t* cbw;           // the command for MSC_FAT_OP_SCSI
+    msc_fat_io_cb_t complete_cb;    // if NULL, the request is posted to the completion ring instead
+    uintptr_t user_arg;
+    volatile msc_fat_xfer_status_t status;
+};
+
 uint8_t msc_map_next_pdrv(uint8_t daddr);
 uint8_t msc_unmap_pdrv(uint8_t daddr);
+uint8_t msc_pdrv_to_daddr(uint8_t pdrv);
+uint8_t msc_daddr_to_pdrv(uint8_t daddr);
 
 /**
- * @brief set the status to drive unplugged
+ * @brief set the status to drive unplugged and discard what is cached for it
+ *
+ * Requests queued on the drive fail first, so a core that is using the
+ * drive lets go of it. It does not wait: if the drive is in use, what is
+ * cached is discarded by msc_fat_task() once the drive lock is free.
+ * Must only be called on MSC_FAT_USB_CORE; it may be called from a
+ * tinyusb callback.
  * 
  * @param pdrv the physical drive number
  */
 void msc_fat_unplug(BYTE pdrv);
 
+/**
+ * @brief check if unplugging the drive discarded cached writes that never
+ * reached it; the result is true once for each such unplug
+ *
+ * @param pdrv the physical drive number
+ * @return true if cached writes were discarded since the last call
+ */
+bool msc_fat_writes_lost(BYTE pdrv);
+
 /**
  * @brief set the status to drive present
  * 
@@ -101,33 +221,79 @@ void msc_fat_plug_in(BYTE pdrv);
  */
 bool msc_fat_is_plugged_in(BYTE pdrv);
 
+/**
+ * @brief write combined sectors that have waited too long, issue
+ * deferred SYNCHRONIZE CACHE commands and finish unplugging drives
+ *
+ * Call it from the main loop.
+ */
+void msc_fat_task();
+
+/**
+ * @brief write all dirty cached and combined sectors to the drive and
+ * wait for the drive to commit them to the medium
+ *
+ * disk_ioctl(CTRL_SYNC) does this too unless MSC_FAT_SYNC_DELAY_MS
+ * defers the SYNCHRONIZE CACHE command.
+ *
+ * @param pdrv the physical drive number
+ * @return RES_OK if the data is on the medium
+ */
+DRESULT msc_fat_sync(BYTE pdrv);
+
+/**
+ * @brief write all dirty cached and combined sectors to the drive
+ * Call it before the drive is
+ * unmounted; anything still cached when the drive is unplugged is lost.
+ *
+ * @param pdrv the physical drive number
+ * @return RES_OK if every dirty sector was written
+ */
+DRESULT msc_fat_flush(BYTE pdrv);
+
+/**
+ * @brief get the limits the drive reported when it was initialized
+ *
+ * @param pdrv the physical drive number
+ * @return const msc_fat_limits_t* the limits or NULL if pdrv is not valid
+ */
+const msc_fat_limits_t* msc_fat_get_limits(BYTE pdrv);
+
 /**
  * @brief initialize the diskio module for use with the MSC
  */
 void msc_fat_init();
 
 /**
- * @brief set the current transfer status
+ * @brief set the current transfer status of a drive
  * 
+ * @param dev_addr the USB device address of the drive
  * @param stat the transfer status
  */
-void msc_fat_set_status(msc_fat_xfer_status_t stat);
+void msc_fat_set_status(uint8_t dev_addr, msc_fat_xfer_status_t stat);
 
 /**
- * @brief get the current transfer status
+ * @brief get the current transfer status of a drive
  * 
- * @return msc_fat_xfer_status_t the current transfer status
+ * @param dev_addr the USB device address of the drive
+ * @return msc_fat_xfer_status_t MSC_FAT_IN_PROGRESS if the drive has queued
+ * requests; otherwise, the status of the last completed transfer
  */
-msc_fat_xfer_status_t msc_fat_get_xfer_status();
+msc_fat_xfer_status_t msc_fat_get_xfer_status(uint8_t dev_addr);
 
 /**
- * @brief wait for the current MSC transfer to complete
+ * @brief wait for all MSC transfers to the drive to complete
  * 
+ * @param dev_addr the USB device address of the drive
  */
-void msc_fat_wait_transfer_complete();
+void msc_fat_wait_transfer_complete(uint8_t dev_addr);
 
 /**
- * @brief callback when the current pending MSC transfer is complete
+ * @brief callback when a pending MSC transfer that was not queued is complete
+ *
+ * Pass it to tinyusb MSC commands issued directly, then set the status
+ * of the drive to MSC_FAT_IN_PROGRESS before issuing the command and
+ * wait for it with msc_fat_wait_transfer_complete().
  * 
  * @param dev_addr the address of the attached MSC device
  * @param cb_data a pointer to the data used by the callback
@@ -137,13 +303,116 @@ void msc_fat_wait_transfer_complete();
 bool msc_fat_complete_cb(uint8_t dev_addr, tuh_msc_complete_data_t const* cb_data);
 
 /**
- * @brief The task function for the main() function "superloop"
+ * @brief queue a read or write request on the drive io->pdrv
+ *
+ * The command is issued immediately if the drive is idle; otherwise it
+ * is issued from the completion callback of the command ahead of it.
+ *
+ * @param io the request to queue
+ * @return true if the request was queued
+ * @return false if the parameters are bad, the drive is not ready or the queue is full
+ */
+bool msc_fat_submit(msc_fat_io_t* io);
+
+/**
+ * @brief fill in io as a read request and queue it
+ *
+ * @return true if the request was queued
+ */
+bool msc_fat_read_async(msc_fat_io_t* io, BYTE pdrv, BYTE* buff, LBA_t sector, UINT count,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg);
+
+/**
+ * @brief fill in io as a write request and queue it
+ *
+ * The drive's caches are kept coherent with the new data. If the range
+ * overlaps sectors waiting to be combined or trimmed, they are sent
+ * first, which blocks, so do not call it from a completion callback.
+ *
+ * @return true if the request was queued
+ */
+bool msc_fat_write_async(msc_fat_io_t* io, BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg);
+
+/**
+ * @brief fill in io as a SCSI command request and queue it
+ *
+ * @param cbw the command block wrapper, set up with msc_fat_cbw_init()
+ * @param data the data stage buffer or NULL if the command has no data stage
+ * @return true if the request was queued
+ */
+bool msc_fat_scsi_async(msc_fat_io_t* io, BYTE pdrv, const msc_cbw_t* cbw, void* data,
+    msc_fat_io_cb_t complete_cb, uintptr_t user_arg);
+
+/**
+ * @brief initialize a command block wrapper for msc_fat_scsi_async()
+ *
+ * @param cbw the CBW to initialize
+ * @param cmd_len the length of the SCSI command block
+ * @param total_bytes the length of the data stage
+ * @param dir_in true if the data stage is from the drive to the host
+ */
+void msc_fat_cbw_init(msc_cbw_t* cbw, uint8_t cmd_len, uint32_t total_bytes, bool dir_in);
+
+/**
+ * @brief remove the oldest request from the drive's completion ring
+ *
+ * Only requests submitted without a complete_cb are posted to the completion ring.
+ *
+ * @param pdrv the physical drive number
+ * @return msc_fat_io_t* the completed request or NULL if there is none
+ */
+msc_fat_io_t* msc_fat_reap(BYTE pdrv);
+
+/**
+ * @brief block until the request completes
+ *
+ * On MSC_FAT_USB_CORE this runs tuh_task() and msc_fat_usb_task(), so
+ * do not call it from a tinyusb callback; on the other core it sleeps in
+ * __wfe() between completions.
+ *
+ * @param io a queued request
+ */
+void msc_fat_io_wait(msc_fat_io_t* io);
+
+#define MSC_FAT_WAIT_FOREVER UINT32_MAX
+
+/**
+ * @brief take a recursive mutex that may be held by the other core
+ *
+ * On MSC_FAT_USB_CORE this runs tuh_task() and msc_fat_usb_task() while
+ * it waits, since the owner may be waiting for a transfer only the USB
+ * core can finish; on the other core it sleeps.
+ *
+ * @param mtx the mutex
+ * @param timeout_ms the most milliseconds to wait or MSC_FAT_WAIT_FOREVER
+ * @return true if the caller owns the mutex
+ */
+bool msc_fat_mutex_enter(recursive_mutex_t* mtx, uint32_t timeout_ms);
+
+/**
+ * @brief take the drive's lock; the disk functions hold it while they run
+ *
+ * Hold it while queueing and reaping asynchronous requests on a drive
+ * that the other core may be using too. Calls may be nested.
+ *
+ * @param pdrv the physical drive number
+ */
+void msc_fat_lock(BYTE pdrv);
+
+/**
+ * @brief release the drive's lock taken by msc_fat_lock()
+ *
+ * @param pdrv the physical drive number
+ */
+void msc_fat_unlock(BYTE pdrv);
+
+/**
+ * @brief issue requests that were queued from the other core
  *
- * This function must call tuh_task() and may call whatever functions
- * are required to make the main loop feel responsive whilst
- * msc_fat_wait_transfer_complete() blocks for completed transfers
+ * Call it after tuh_task() in the loop on MSC_FAT_USB_CORE.
  */
-void main_loop_task();
+void msc_fat_usb_task();
 #ifdef __cplusplus
 }
 #endif
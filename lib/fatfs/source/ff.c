@@ -277,6 +277,33 @@
 #endif
 
 
+/* Window cache */
+#if FF_FS_WINCACHE && FF_FS_TINY
+#error FF_FS_WINCACHE must be 0 at tiny configuration
+#endif
+
+
+/* Directory index */
+#if FF_FS_DIR_INDEX
+#if FF_FS_REENTRANT
+#define N_DIRIDX	FF_VOLUMES	/* Each volume has its own index, guarded by the volume lock */
+#else
+#define N_DIRIDX	1			/* All volumes share an index */
+#endif
+#define SZ_DIRIDX	(FF_FS_DIR_INDEX / N_DIRIDX)	/* Size of an index buffer */
+typedef struct {
+	FATFS*	fs;		/* Filesystem object of the indexed directory (NULL:blank) */
+	WORD	id;		/* Volume mount ID of the filesystem object */
+	DWORD	sclust;	/* Start cluster of the directory (0:root) */
+	DWORD	nent;	/* Number of entries indexed (always at an object boundary) */
+	UINT	nobj;	/* Number of objects indexed */
+	UINT	nsect;	/* Number of directory sectors having an object count */
+	BYTE	stat;	/* 0:More objects may follow, 1:End of table is at nent, 2:No room for more objects */
+	BYTE	buf[SZ_DIRIDX];	/* Name hashes of each object from the top, object counts of each sector from the bottom */
+} DIRINDEX;
+#endif
+
+
 /* File lock controls */
 #if FF_FS_LOCK != 0
 #if FF_FS_READONLY
@@ -472,6 +499,10 @@ static BYTE CurrVol;				/* Current drive */
 static FILESEM Files[FF_FS_LOCK];	/* Open object lock semaphores */
 #endif
 
+#if FF_FS_DIR_INDEX
+static DIRINDEX DirIdx[N_DIRIDX];	/* Directory index */
+#endif
+
 #if FF_STR_VOLUME_ID
 #ifdef FF_VOLUME_STRS
 static const char* const VolumeStr[FF_VOLUMES] = {FF_VOLUME_STRS};	/* Pre-defined volume ID */
@@ -1022,6 +1053,54 @@ static void clear_lock (	/* Clear lock entries of the volume */
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
 #if !FF_FS_READONLY
+static FRESULT write_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,			/* Filesystem object */
+	const BYTE* buf,	/* Window data */
+	LBA_t sect			/* Sector LBA of the window */
+)
+{
+#if FF_FS_MIRROR_DEFER
+	DWORD ofs, lo, hi;
+	UINT i, n;
+#endif
+
+
+	if (disk_write(fs->pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;	/* Write it back into the volume */
+	if (sect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
+		if (fs->n_fats == 2) {
+#if FF_FS_MIRROR_DEFER
+			ofs = (DWORD)(sect - fs->fatbase);
+			lo = fs->mir_lo; hi = fs->mir_hi;
+			if (lo == hi) {		/* No pending range? */
+				lo = ofs; hi = ofs + 1;
+			} else {
+				if (ofs < lo) lo = ofs;
+				if (ofs >= hi) hi = ofs + 1;
+			}
+			if (hi - lo <= FF_FS_MIRROR_DEFER) {	/* Reflect it to 2nd FAT at sync */
+				if (fs->mir_lo != fs->mir_hi && lo < fs->mir_lo) {	/* Move the pending sectors up in the bitmap */
+					n = (UINT)(fs->mir_lo - lo);
+					for (i = FF_FS_MIRROR_DEFER; i-- > 0; ) {
+						if (i >= n && (fs->mir_map[(i - n) / 8] & (1 << ((i - n) % 8)))) {
+							fs->mir_map[i / 8] |= 1 << (i % 8);
+						} else {
+							fs->mir_map[i / 8] &= ~(1 << (i % 8));
+						}
+					}
+				}
+				i = (UINT)(ofs - lo);
+				fs->mir_map[i / 8] |= 1 << (i % 8);	/* Mark the sector to be mirrored */
+				fs->mir_lo = lo; fs->mir_hi = hi;
+				return FR_OK;
+			}
+#endif
+			disk_write(fs->pdrv, buf, sect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+		}
+	}
+	return FR_OK;
+}
+
+
 static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs			/* Filesystem object */
 )
@@ -1030,16 +1109,121 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (fs->wflag) {	/* Is the disk access window dirty? */
-		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
-			fs->wflag = 0;	/* Clear window dirty flag */
-			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
-			}
+		res = write_window(fs, fs->win, fs->winsect);
+		if (res == FR_OK) fs->wflag = 0;	/* Clear window dirty flag */
+	}
+	return res;
+}
+#endif
+
+
+#if FF_FS_WINCACHE && !FF_FS_READONLY
+static void init_wcache (
+	FATFS* fs			/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	fs->wc_n = (BYTE)(sizeof fs->wc_buf / SS(fs));	/* Number of windows fit in the cache */
+	fs->wc_nfat = (fs->wc_n + 1) / 2;
+	fs->wc_tick = 0;
+	for (i = 0; i < FF_FS_WINCACHE; i++) {
+		fs->wc_flag[i] = 0; fs->wc_age[i] = 0; fs->wc_sect[i] = (LBA_t)0 - 1;
+	}
+}
+
+
+static void inval_wcache (
+	FATFS* fs,			/* Filesystem object */
+	LBA_t sect,			/* Top of the sectors to discard from the cache */
+	UINT n				/* Number of sectors */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < fs->wc_n; i++) {
+		if (fs->wc_age[i] && fs->wc_sect[i] - sect < n) {
+			fs->wc_flag[i] = 0; fs->wc_age[i] = 0; fs->wc_sect[i] = (LBA_t)0 - 1;
+		}
+	}
+}
+
+
+static FRESULT sync_wcache (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs			/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < fs->wc_n; i++) {
+		if (fs->wc_flag[i] & 1) {	/* Is the cached window dirty? */
+			if (write_window(fs, fs->wc_buf + i * SS(fs), fs->wc_sect[i]) != FR_OK) return FR_DISK_ERR;
+			fs->wc_flag[i] = 0;
+		}
+	}
+	return FR_OK;
+}
+
+
+static FRESULT swap_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* Sector LBA to make appearance in the fs->win[] */
+)
+{
+	UINT i, n, h, p, ss = SS(fs);
+	BYTE b, flag, *wb;
+
+
+	for (h = 0; h < fs->wc_n && (!fs->wc_age[h] || fs->wc_sect[h] != sect); h++) ;	/* Is the sector in the cache? */
+	flag = (h < fs->wc_n) ? fs->wc_flag[h] : 0;
+
+	/* Find a cached window to move the current window to */
+	p = fs->wc_n;
+	if (fs->winsect != (LBA_t)0 - 1) {
+		if (fs->winsect - fs->fatbase < fs->fsize) {	/* FAT sectors and other sectors use their own windows */
+			i = 0; n = fs->wc_nfat;
+		} else {
+			i = fs->wc_nfat; n = fs->wc_n;
+		}
+		if (h >= i && h < n) {
+			p = h;		/* Exchange the current window with the cached one */
 		} else {
-			res = FR_DISK_ERR;
+			for ( ; i < n; i++) {	/* Least recently used one (an empty one has the age of 0) */
+				if (p == fs->wc_n || fs->wc_age[i] < fs->wc_age[p]) p = i;
+			}
 		}
 	}
-	return res;
+	if (p == fs->wc_n) {	/* The current window cannot be cached */
+		if (sync_window(fs) != FR_OK) return FR_DISK_ERR;
+	} else if (p != h && (fs->wc_flag[p] & 1)) {	/* Write back the window to be replaced if it is dirty */
+		if (write_window(fs, fs->wc_buf + p * ss, fs->wc_sect[p]) != FR_OK) return FR_DISK_ERR;
+	}
+
+	/* Move the current window out and the requested sector in */
+	if (p == h) {
+		for (wb = fs->wc_buf + p * ss, i = 0; i < ss; i++) {
+			b = fs->win[i]; fs->win[i] = wb[i]; wb[i] = b;
+		}
+	} else {
+		if (p < fs->wc_n) memcpy(fs->wc_buf + p * ss, fs->win, ss);
+		if (h < fs->wc_n) {
+			memcpy(fs->win, fs->wc_buf + h * ss, ss);
+			fs->wc_flag[h] = 0; fs->wc_age[h] = 0; fs->wc_sect[h] = (LBA_t)0 - 1;
+		}
+	}
+	if (p < fs->wc_n) {
+		fs->wc_flag[p] = fs->wflag; fs->wc_age[p] = ++fs->wc_tick; fs->wc_sect[p] = fs->winsect;
+	}
+	fs->wflag = flag;
+	if (h == fs->wc_n && disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {	/* Fill sector window with new data if not cached */
+		fs->winsect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
+		return FR_DISK_ERR;
+	}
+	fs->winsect = sect;
+	return FR_OK;
 }
 #endif
 
@@ -1053,6 +1237,9 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (sect != fs->winsect) {	/* Window offset changed? */
+#if FF_FS_WINCACHE && !FF_FS_READONLY
+		res = swap_window(fs, sect);	/* Exchange the window with the cache */
+#else
 #if !FF_FS_READONLY
 		res = sync_window(fs);		/* Flush the window */
 #endif
@@ -1063,6 +1250,7 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 			}
 			fs->winsect = sect;
 		}
+#endif
 	}
 	return res;
 }
@@ -1075,6 +1263,26 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 /* Synchronize filesystem and data on the storage                        */
 /*-----------------------------------------------------------------------*/
 
+#if FF_FS_MIRROR_DEFER
+static FRESULT sync_mirror (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < fs->mir_hi - fs->mir_lo; i++) {	/* Copy the written sectors from 1st FAT to 2nd FAT */
+		if (!(fs->mir_map[i / 8] & (1 << (i % 8)))) continue;
+		if (move_window(fs, fs->fatbase + fs->mir_lo + i) != FR_OK) return FR_DISK_ERR;
+		if (disk_write(fs->pdrv, fs->win, fs->fatbase + fs->fsize + fs->mir_lo + i, 1) != RES_OK) return FR_DISK_ERR;
+		fs->mir_map[i / 8] &= ~(1 << (i % 8));
+	}
+	fs->mir_lo = fs->mir_hi = 0;
+	return FR_OK;
+}
+#endif
+
+
 static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs		/* Filesystem object */
 )
@@ -1083,6 +1291,12 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	res = sync_window(fs);
+#if FF_FS_WINCACHE
+	if (res == FR_OK) res = sync_wcache(fs);
+#endif
+#if FF_FS_MIRROR_DEFER
+	if (res == FR_OK) res = sync_mirror(fs);
+#endif
 	if (res == FR_OK) {
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {	/* FAT32: Update FSInfo sector if needed */
 			/* Create FSInfo structure */
@@ -1094,6 +1308,9 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
 			fs->winsect = fs->volbase + 1;						/* Write it into the FSInfo sector (Next to VBR) */
 			disk_write(fs->pdrv, fs->win, fs->winsect, 1);
+#if FF_FS_WINCACHE
+			inval_wcache(fs, fs->winsect, 1);					/* Discard the old FSInfo if it is cached */
+#endif
 			fs->fsi_flag = 0;
 		}
 		/* Make sure that no pending write process in the lower layer */
@@ -1262,6 +1479,68 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_FS_FREE_MAP && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free map of cluster groups                             */
+/*-----------------------------------------------------------------------*/
+
+static void init_fmap (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	BYTE sh = 0;
+
+
+	while (((fs->n_fatent - 1) >> sh) >= FF_FS_FREE_MAP * 8) sh++;	/* Fewest clusters per bit to cover the volume */
+	fs->fmap_shift = sh;
+	fs->fmap_free = 0;
+	memset(fs->fmap, 0xFF, sizeof fs->fmap);	/* Every group may have free clusters */
+}
+
+
+static int test_fmap (	/* 0:The group has no free cluster, !=0:The group may have free clusters */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst		/* A cluster in the group */
+)
+{
+	DWORD g = clst >> fs->fmap_shift;
+
+
+	return fs->fmap[g / 8] & (1 << (g % 8));
+}
+
+
+static void put_fmap (
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst,		/* A cluster in the group */
+	int val			/* 0:The group has no free cluster, 1:A cluster in the group is removed */
+)
+{
+	DWORD g = clst >> fs->fmap_shift;
+
+
+	if (val) {
+		fs->fmap[g / 8] |= 1 << (g % 8);
+		fs->fmap_free = 1;		/* The group being scanned might be this one */
+	} else {
+		fs->fmap[g / 8] &= ~(1 << (g % 8));
+	}
+}
+
+
+static int last_fmap (	/* !=0:The cluster is the last one in its group */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst		/* Cluster number */
+)
+{
+	return ((clst + 1) & ((1UL << fs->fmap_shift) - 1)) == 0 || clst == fs->n_fatent - 1;
+}
+
+#endif	/* FF_FS_FREE_MAP && !FF_FS_READONLY */
+
+
+
+
 #if FF_FS_EXFAT && !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* exFAT: Accessing FAT and Allocation Bitmap                            */
@@ -1277,33 +1556,65 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	DWORD ncl	/* Number of contiguous clusters to find (1..) */
 )
 {
-	BYTE bm, bv;
-	UINT i;
-	DWORD val, scl, ctr;
+	BYTE bv;
+	DWORD val, scl, ctr, nbit, wv;
 
 
+	if (fs->bm_run_ncl >= ncl) {	/* Is the scan going to end in the cached free run? */
+		if (clst == fs->bm_run_clst || (clst == fs->bm_run_clst - 1 && fs->bm_run_lead)) return fs->bm_run_clst;
+	}
+	nbit = fs->n_fatent - 2;
 	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
-	if (clst >= fs->n_fatent - 2) clst = 0;
+	if (clst >= nbit) clst = 0;
 	scl = val = clst; ctr = 0;
 	for (;;) {
 		if (move_window(fs, fs->bitbase + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
-		i = val / 8 % SS(fs); bm = 1 << (val % 8);
 		do {
-			do {
-				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
-				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
-					val = 0; bm = 0; i = SS(fs);
+			if (val % 32 == 0 && val + 32 < nbit && (clst <= val || clst > val + 32)) {	/* 32 bits with no wrap-around and no scan end in it? */
+				wv = ld_dword(fs->win + val / 8 % SS(fs));
+				if (wv == 0 && ctr + 32 >= ncl) {	/* Does a free word complete the run? */
+					ctr = ncl; val = scl + ncl;
+					break;
 				}
-				if (bv == 0) {	/* Is it a free cluster? */
-					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
-				} else {
-					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
+				if (wv == 0) {	/* 32 free clusters */
+					ctr += 32; val += 32;
+					continue;
+				}
+				if (wv == 0xFFFFFFFF) {	/* 32 clusters in use, restart to scan */
+					val += 32; scl = val; ctr = 0;
+					continue;
 				}
-				if (val == clst) return 0;	/* All cluster scanned? */
-			} while (bm != 0);
-			bm = 1;
-		} while (++i < SS(fs));
+			}
+			bv = fs->win[val / 8 % SS(fs)] & (1 << (val % 8));	/* Get bit value */
+			if (++val >= nbit) val = 0;		/* Next cluster (with wrap-around) */
+			if (bv == 0) {	/* Is it a free cluster? */
+				if (++ctr == ncl) break;	/* Check if run length is sufficient for required */
+			} else {
+				scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
+			}
+			if (val == clst) return 0;	/* All cluster scanned? */
+		} while (val % (SS(fs) * 8) != 0);
+		if (ctr == ncl) break;
 	}
+
+	/* Cache the found run, stretched over the free clusters that follow it in the window */
+	ctr = 0;	/* Do not cache a run that wraps around */
+	if (scl + ncl <= nbit) {
+		val = scl + ncl;
+		while (val < nbit && fs->winsect == fs->bitbase + val / 8 / SS(fs)) {
+			if (val % 32 == 0 && val + 32 <= nbit && ld_dword(fs->win + val / 8 % SS(fs)) == 0) {
+				val += 32;
+			} else {
+				if (fs->win[val / 8 % SS(fs)] & (1 << (val % 8))) break;
+				val++;
+			}
+		}
+		ctr = val - scl;
+	}
+	fs->bm_run_clst = scl + 2;
+	fs->bm_run_ncl = ctr;
+	fs->bm_run_lead = 0;
+	return scl + 2;
 }
 
 
@@ -1321,23 +1632,54 @@ static FRESULT change_bitmap (
 	BYTE bm;
 	UINT i;
 	LBA_t sect;
+	DWORD rend;
 
 
+	/* Keep the cached free run in sync with the bitmap */
+	rend = fs->bm_run_clst + fs->bm_run_ncl;
+	if (bv) {
+		if (clst == fs->bm_run_clst && ncl <= fs->bm_run_ncl) {	/* Allocated from the head of the run? */
+			fs->bm_run_clst += ncl; fs->bm_run_ncl -= ncl; fs->bm_run_lead = 1;
+		} else if (clst < rend && fs->bm_run_clst < clst + ncl) {	/* Allocated in the middle of the run? */
+			fs->bm_run_ncl = 0;
+		}
+	} else {
+		if (clst < fs->bm_run_clst && fs->bm_run_clst <= clst + ncl) fs->bm_run_lead = 0;	/* Freed the cluster before the run? */
+		if (fs->bm_run_ncl && clst + ncl == fs->bm_run_clst) {	/* Freed just before the run? */
+			fs->bm_run_clst = clst; fs->bm_run_ncl += ncl;
+		}
+	}
+
 	clst -= 2;	/* The first bit corresponds to cluster #2 */
 	sect = fs->bitbase + clst / 8 / SS(fs);	/* Sector address */
 	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
 	bm = 1 << (clst % 8);					/* Bit mask in the byte */
 	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
-		do {
-			do {
-				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
+		if (move_window(fs, sect++) != FR_OK) {
+			fs->bm_run_ncl = 0;
+			return FR_DISK_ERR;
+		}
+		while (i < SS(fs)) {
+			if (bm == 1 && i % 4 == 0 && ncl >= 32) {	/* 32 bits at a time */
+				if (ld_dword(fs->win + i) != (bv ? 0 : 0xFFFFFFFF)) break;	/* Is any bit already the new value? */
+				st_dword(fs->win + i, bv ? 0xFFFFFFFF : 0);
+				fs->wflag = 1;
+				i += 4;
+				if ((ncl -= 32) == 0) return FR_OK;	/* All bits processed? */
+			} else {
+				if (bv == (int)((fs->win[i] & bm) != 0)) break;	/* Is the bit expected value? */
 				fs->win[i] ^= bm;	/* Flip the bit */
 				fs->wflag = 1;
 				if (--ncl == 0) return FR_OK;	/* All bits processed? */
-			} while (bm <<= 1);		/* Next bit */
-			bm = 1;
-		} while (++i < SS(fs));		/* Next byte */
+				if ((bm <<= 1) == 0) {		/* Next bit */
+					bm = 1; i++;			/* Next byte */
+				}
+			}
+		}
+		if (i < SS(fs)) {	/* Found a bit that was already the new value */
+			fs->bm_run_ncl = 0;
+			return FR_INT_ERR;
+		}
 		i = 0;
 	}
 }
@@ -1434,6 +1776,12 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
+#if FF_FS_FREE_SCAN
+		if (clst < fs->scan_clst) fs->scan_free++;	/* Already checked by the free cluster scan? */
+#endif
+#if FF_FS_FREE_MAP
+		put_fmap(fs, clst, 1);			/* The group has a free cluster */
+#endif
 #if FF_FS_EXFAT || FF_USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -1499,6 +1847,9 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	DWORD cs, ncl, scl;
 	FRESULT res;
 	FATFS *fs = obj->fs;
+#if FF_FS_FREE_MAP
+	int walk = 0;
+#endif
 
 
 	if (clst == 0) {	/* Create a new chain */
@@ -1561,9 +1912,23 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 					ncl = 2;
 					if (ncl > scl) return 0;	/* No free cluster found? */
 				}
+#if FF_FS_FREE_MAP
+				if (!test_fmap(fs, ncl)) {		/* Skip the group if it has no free cluster */
+					cs = ncl | ((1UL << fs->fmap_shift) - 1);	/* Last cluster in the group */
+					if (cs >= fs->n_fatent) cs = fs->n_fatent - 1;
+					if (ncl <= scl && scl <= cs) return 0;	/* No free cluster found? */
+					ncl = cs;
+					walk = 1;					/* Next group is read from its top */
+					continue;
+				}
+				if (ncl == 2 || (ncl & ((1UL << fs->fmap_shift) - 1)) == 0) walk = 1;	/* Top of a group? */
+#endif
 				cs = get_fat(obj, ncl);			/* Get the cluster status */
 				if (cs == 0) break;				/* Found a free cluster? */
 				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+#if FF_FS_FREE_MAP
+				if (walk && last_fmap(fs, ncl)) put_fmap(fs, ncl, 0);	/* Whole group is read and has no free cluster */
+#endif
 				if (ncl == scl) return 0;		/* No free cluster found? */
 			}
 		}
@@ -1577,6 +1942,9 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		fs->last_clst = ncl;
 		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
 		fs->fsi_flag |= 1;
+#if FF_FS_FREE_SCAN
+		if (ncl < fs->scan_clst) fs->scan_free--;	/* Already checked by the free cluster scan? */
+#endif
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
@@ -1589,6 +1957,77 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 
 
 
+#if FF_FS_FREE_SCAN && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Count free clusters a part of the FAT at a time        */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT scan_free (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* Filesystem object */
+	UINT nsect		/* Number of FAT/bitmap sectors to scan (0:to the end) */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD clst, nent, stat;
+	FFOBJID obj;
+
+
+	if (fs->scan_clst == 0xFFFFFFFF) return FR_OK;	/* Already completed? */
+	if (fs->scan_clst < 2) {	/* Start a new scan */
+		fs->scan_clst = 2; fs->scan_free = 0;
+#if FF_FS_FREE_MAP
+		fs->fmap_free = 0;
+#endif
+	}
+	switch (fs->fs_type) {	/* Number of entries in a sector */
+	case FS_FAT12:	nent = SS(fs) * 2 / 3; break;
+	case FS_FAT16:	nent = SS(fs) / 2; break;
+#if FF_FS_EXFAT
+	case FS_EXFAT:	nent = SS(fs) * 8; break;
+#endif
+	default:		nent = SS(fs) / 4;
+	}
+	nent = (nsect == 0 || nsect >= fs->fsize) ? fs->n_fatent : nent * nsect;
+
+	obj.fs = fs;
+	for (clst = fs->scan_clst; clst < fs->n_fatent && nent; clst++, nent--) {
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* exFAT: Check the allocation bitmap */
+			res = move_window(fs, fs->bitbase + (clst - 2) / 8 / SS(fs));
+			if (res != FR_OK) break;
+			if (!(fs->win[(clst - 2) / 8 % SS(fs)] & (1 << ((clst - 2) % 8)))) fs->scan_free++;
+			continue;
+		}
+#endif
+		stat = get_fat(&obj, clst);		/* FAT12/16/32: Check the FAT entry */
+		if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (stat == 1) { res = FR_INT_ERR; break; }
+		if (stat == 0) fs->scan_free++;
+#if FF_FS_FREE_MAP
+		if (stat == 0) fs->fmap_free = 1;
+		if (last_fmap(fs, clst)) {		/* End of a group? */
+			if (!fs->fmap_free) put_fmap(fs, clst, 0);	/* It has no free cluster */
+			fs->fmap_free = 0;
+		}
+#endif
+	}
+	fs->scan_clst = clst;	/* Resume from here next time */
+
+	if (res == FR_OK && clst >= fs->n_fatent) {	/* Completed? */
+		if (fs->free_clst != fs->scan_free) {	/* FSINFO was wrong or not available */
+			fs->free_clst = fs->scan_free;
+			fs->fsi_flag |= 1;
+		}
+		fs->scan_clst = 0xFFFFFFFF;		/* Now free_clst is verified */
+	}
+	return res;
+}
+
+#endif	/* FF_FS_FREE_SCAN && !FF_FS_READONLY */
+
+
+
+
 #if FF_USE_FASTSEEK
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Convert offset into cluster with link map table        */
@@ -1614,11 +2053,97 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 	return cl + *tbl;	/* Return the cluster number */
 }
 
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Create the link map table of a file                    */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT create_clmt (	/* FR_OK, FR_NOT_ENOUGH_CORE:Table is too small, FR_INT_ERR or FR_DISK_ERR */
+	FIL* fp			/* Pointer to the file object with the table size in cltbl[0] */
+)
+{
+	DWORD cl, pcl, ncl, tcl, tlen, ulen;
+	DWORD *tbl;
+	FATFS *fs = fp->obj.fs;
+
+
+	tbl = fp->cltbl;
+	tlen = *tbl++; ulen = 2;	/* Given table size and required table size */
+	cl = fp->obj.sclust;		/* Origin of the chain */
+	if (cl != 0) {
+		do {
+			/* Get a fragment */
+			tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
+			do {
+				pcl = cl; ncl++;
+				cl = get_fat(&fp->obj, cl);
+				if (cl <= 1) return FR_INT_ERR;
+				if (cl == 0xFFFFFFFF) return FR_DISK_ERR;
+			} while (cl == pcl + 1);
+			if (ulen <= tlen) {		/* Store the length and top of the fragment */
+				*tbl++ = ncl; *tbl++ = tcl;
+			}
+		} while (cl < fs->n_fatent);	/* Repeat until end of chain */
+	}
+	*fp->cltbl = ulen;	/* Number of items used */
+	if (ulen > tlen) return FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
+	*tbl = 0;		/* Terminate table */
+	return FR_OK;
+}
+
+
+#if FF_CLMT_POOL_TABLES
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Give a large read-only file a table from the pool      */
+/*-----------------------------------------------------------------------*/
+
+static void auto_clmt (
+	FIL* fp			/* Pointer to the file object just opened */
+)
+{
+	fp->pooltbl = 0;
+	if ((fp->flag & FA_WRITE) || fp->obj.objsize < FF_CLMT_AUTO_SIZE) return;	/* The file may grow or seeking it is cheap */
+	fp->pooltbl = ff_clmt_alloc();
+	if (!fp->pooltbl) return;	/* Pool is empty, follow the FAT chain */
+	fp->pooltbl[0] = FF_CLMT_TABLE_ITEMS;
+	fp->cltbl = fp->pooltbl;
+	if (create_clmt(fp) != FR_OK) {	/* Too fragmented or an error, follow the FAT chain */
+		fp->cltbl = 0;
+		ff_clmt_free(fp->pooltbl);
+		fp->pooltbl = 0;
+	}
+}
+#endif
+
 #endif	/* FF_USE_FASTSEEK */
 
 
 
 
+#if FF_FS_DIR_INDEX
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Get the directory index of a volume              */
+/*-----------------------------------------------------------------------*/
+
+static DIRINDEX* get_index (	/* Returns pointer to the directory index of the volume */
+	FATFS* fs		/* Filesystem object */
+)
+{
+#if FF_FS_REENTRANT
+	UINT vol;
+
+
+	for (vol = 0; vol < FF_VOLUMES - 1 && FatFs[vol] != fs; vol++) ;	/* Find the volume of the filesystem object */
+	return &DirIdx[vol];
+#else
+	(void)fs;
+	return &DirIdx[0];
+#endif
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Fill a cluster with zeros                        */
 /*-----------------------------------------------------------------------*/
@@ -1632,12 +2157,22 @@ static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
 	LBA_t sect;
 	UINT n, szb;
 	BYTE *ibuf;
+#if FF_FS_DIR_INDEX
+	DIRINDEX *di;
+#endif
 
 
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
+#if FF_FS_DIR_INDEX
+	di = get_index(fs);
+	if (di->fs == fs && di->sclust == clst) di->fs = 0;	/* Discard the index of a removed directory */
+#endif
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
 	fs->winsect = sect;				/* Set window to top of the cluster */
 	memset(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
+#if FF_FS_WINCACHE
+	inval_wcache(fs, sect, fs->csize);	/* Discard cached windows of the cluster */
+#endif
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
 	/* Allocate a temporary buffer */
 	for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
@@ -2325,24 +2860,268 @@ static FRESULT dir_read (
 					if (ord != 0 || sum != sum_sfn(dp->dir)) {	/* Is there a valid LFN? */
 						dp->blk_ofs = 0xFFFFFFFF;	/* It has no LFN. */
 					}
-					break;
+					break;
+				}
+			}
+#else		/* Non LFN configuration */
+			if (b != DDEM && b != '.' && attr != AM_LFN && (int)((attr & ~AM_ARC) == AM_VOL) == vol) {	/* Is it a valid entry? */
+				break;
+			}
+#endif
+		}
+		res = dir_next(dp, 0);		/* Next entry */
+		if (res != FR_OK) break;
+	}
+
+	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
+	return res;
+}
+
+#endif	/* FF_FS_MINIMIZE <= 1 || FF_USE_LABEL || FF_FS_RPATH >= 2 */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Compare the objects in the directory with a name */
+/*-----------------------------------------------------------------------*/
+
+#if FF_FS_DIR_INDEX
+static DWORD hash_chr (	/* Hash value of a character at a position in the name */
+	UINT pos,		/* Position in the name */
+	WCHAR chr		/* Character (upper case) */
+)
+{
+	return (((DWORD)pos << 16) | chr) * 0x9E3779B1;
+}
+
+
+static void put_index (
+	DIRINDEX* di,	/* Directory index to add the object to */
+	DIR* dp,		/* Directory object */
+	DWORD ent,		/* Entry index where the object starts */
+	BYTE lkey,		/* Hash of the LFN (or of the SFN if no LFN) */
+	BYTE skey		/* Hash of the SFN */
+)
+{
+	UINT s = (UINT)(ent / (SS(dp->obj.fs) / SZDIRE));	/* Directory sector of the object */
+
+
+	if ((di->nobj + 1) * 2 + (s >= di->nsect ? s + 1 : di->nsect) > SZ_DIRIDX) {
+		di->stat = 2;		/* No room for the object */
+		return;
+	}
+	while (di->nsect <= s) di->buf[SZ_DIRIDX - 1 - di->nsect++] = 0;
+	di->buf[SZ_DIRIDX - 1 - s]++;
+	di->buf[di->nobj * 2] = lkey;
+	di->buf[di->nobj * 2 + 1] = skey;
+	di->nobj++;
+}
+#endif
+
+
+static FRESULT match_name (	/* FR_OK(0):found, FR_NO_FILE:not found, others:error */
+	DIR* dp,		/* Directory object pointing the entry to start with */
+	DWORD end,		/* Stop at the first object boundary at or after this offset */
+	int build		/* Add the objects to the directory index (dp must point the end of the index) */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	BYTE c;
+#if FF_USE_LFN
+	BYTE a, ord, sum, lfn = 0;
+#endif
+#if FF_FS_DIR_INDEX
+	DIRINDEX *di = get_index(fs);
+	DWORD ent, h, l;
+	UINT n;
+#if FF_USE_LFN
+	DWORD bent = 0, bhash = 0;
+	BYTE bord = 0xFF, bsum = 0;
+	UINT i;
+	WCHAR uc;
+#endif
+#else
+	(void)build;
+#endif
+
+#if FF_USE_LFN
+	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+#endif
+	do {
+#if FF_USE_LFN
+		if (dp->dptr >= end && !lfn) { res = FR_NO_FILE; break; }	/* Reached the end of the range? */
+#else
+		if (dp->dptr >= end) { res = FR_NO_FILE; break; }	/* Reached the end of the range? */
+#endif
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+#if FF_FS_DIR_INDEX
+		if (build && di->stat == 0) {	/* Index the object */
+			ent = dp->dptr / SZDIRE;
+			if (c == 0) {				/* End of table */
+				di->nent = ent;
+#if FF_USE_LFN
+			} else if (c != DDEM && (dp->dir[DIR_Attr] & AM_MASK) == AM_LFN) {	/* An LFN entry */
+				if (c & LLEF) {		/* Start of an LFN sequence */
+					bent = ent; bord = c & 0x3F; bsum = dp->dir[LDIR_Chksum]; bhash = 0;
+				}
+				if ((c & 0x3F) == bord && bord && dp->dir[LDIR_Chksum] == bsum) {
+					for (i = ((c & 0x3F) - 1) * 13, n = 0; n < 13; i++, n++) {	/* Hash of the part of LFN */
+						uc = ld_word(dp->dir + LfnOfs[n]);
+						if (uc == 0) break;
+						bhash += hash_chr(i, ff_wtoupper(uc));
+					}
+					bord--;
+				} else {
+					bord = 0xFF;	/* Broken LFN sequence */
+				}
+#endif
+			} else if (c == DDEM || (dp->dir[DIR_Attr] & AM_VOL)) {	/* A deleted entry or volume label */
+#if FF_USE_LFN
+				bord = 0xFF;
+#endif
+				di->nent = ent + 1;
+			} else {					/* An SFN entry */
+				for (h = 0, n = 0; n < 11; n++) h += hash_chr(n, dp->dir[n]);	/* Hash of the SFN */
+				l = h;
+#if FF_USE_LFN
+				if (bord == 0 && bsum == sum_sfn(dp->dir)) {	/* The object starts at its LFN */
+					ent = bent; l = bhash;
+				}
+				bord = 0xFF;
+#endif
+				put_index(di, dp, ent, (BYTE)(l >> 24), (BYTE)(h >> 24));
+				if (di->stat == 0) di->nent = dp->dptr / SZDIRE + 1;
+			}
+		}
+#endif
+		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
+#if FF_USE_LFN		/* LFN configuration */
+		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
+		lfn = 0;
+		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+		} else {
+			if (a == AM_LFN) {			/* An LFN entry is found */
+				lfn = 1;
+				if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
+					if (c & LLEF) {		/* Is it start of LFN sequence? */
+						sum = dp->dir[LDIR_Chksum];
+						c &= (BYTE)~LLEF; ord = c;	/* LFN start order */
+						dp->blk_ofs = dp->dptr;	/* Start offset of LFN */
+					}
+					/* Check validity of the LFN entry and compare it with given name */
+					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
 				}
+			} else {					/* An SFN entry is found */
+				if (ord == 0 && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
+				if (!(dp->fn[NSFLAG] & NS_LOSS) && !memcmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
+				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 			}
+		}
 #else		/* Non LFN configuration */
-			if (b != DDEM && b != '.' && attr != AM_LFN && (int)((attr & ~AM_ARC) == AM_VOL) == vol) {	/* Is it a valid entry? */
-				break;
+		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+		if (!(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
+#endif
+		res = dir_next(dp, 0);	/* Next entry */
+	} while (res == FR_OK);
+
+#if FF_FS_DIR_INDEX
+	if (build && res == FR_NO_FILE && di->stat == 0) di->stat = 1;	/* All objects in the directory are indexed */
+#endif
+	return res;
+}
+
+
+
+#if FF_FS_DIR_INDEX
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Find an object with the directory index          */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT find_index (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp					/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DIRINDEX *di = get_index(fs);
+	UINT s, i, n, hit;
+	DWORD h;
+	BYTE lkey = 0, skey = 0, keys = 0;
+
+
+	if (di->fs != fs || di->id != fs->id || di->sclust != dp->obj.sclust) {	/* The directory is not indexed? */
+		if (di->fs && di->id == di->fs->id) {	/* Another directory is indexed? */
+			res = match_name(dp, 0xFFFFFFFF, 0);	/* Search the directory without the index */
+			if ((res == FR_OK || res == FR_NO_FILE) && dp->dptr / SZDIRE >= di->nent) {
+				di->fs = 0;		/* This directory is larger, index it in the next search */
 			}
+			return res;
+		}
+		di->fs = fs; di->id = fs->id; di->sclust = dp->obj.sclust;	/* Index this directory */
+		di->nent = 0; di->nobj = 0; di->nsect = 0; di->stat = 0;
+	}
+
+	/* Hash values of the name to find */
+#if FF_USE_LFN
+	if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
+		for (h = 0, i = 0; fs->lfnbuf[i]; i++) h += hash_chr(i, ff_wtoupper(fs->lfnbuf[i]));
+		lkey = (BYTE)(h >> 24); keys |= 1;
+	}
+	if (!(dp->fn[NSFLAG] & NS_LOSS))
 #endif
+	{
+		for (h = 0, i = 0; i < 11; i++) h += hash_chr(i, dp->fn[i]);
+		skey = (BYTE)(h >> 24); keys |= 2;
+	}
+
+	/* Search the sectors where an indexed object may have the name */
+	for (s = i = 0; s < di->nsect; s++) {
+		for (hit = 0, n = di->buf[SZ_DIRIDX - 1 - s]; n; n--, i++) {
+			if (((keys & 1) && di->buf[i * 2] == lkey) || ((keys & 2) && di->buf[i * 2 + 1] == skey)) hit = 1;
+		}
+		if (hit) {
+			res = dir_sdi(dp, (DWORD)s * SS(fs));
+			if (res == FR_OK) res = match_name(dp, (DWORD)(s + 1) * SS(fs), 0);
+			if (res != FR_NO_FILE) return res;
 		}
-		res = dir_next(dp, 0);		/* Next entry */
-		if (res != FR_OK) break;
 	}
+	if (di->stat == 1) return FR_NO_FILE;	/* All objects are indexed */
 
-	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
-	return res;
+	/* Search the objects following the index */
+	if (di->nent == 0) {
+		res = dir_sdi(dp, 0);
+	} else {	/* Step over the last indexed entry, the index may end at the end of the table */
+		res = dir_sdi(dp, (di->nent - 1) * SZDIRE);
+		if (res == FR_OK) res = dir_next(dp, 0);
+	}
+	if (res != FR_OK) return res;
+	return match_name(dp, 0xFFFFFFFF, 1);
 }
 
-#endif	/* FF_FS_MINIMIZE <= 1 || FF_USE_LABEL || FF_FS_RPATH >= 2 */
+
+#if !FF_FS_READONLY
+static void alloc_index (
+	DIR* dp,		/* Directory object pointing the last entry allocated */
+	UINT n_ent		/* Number of entries allocated */
+)
+{
+	DIRINDEX *di = get_index(dp->obj.fs);
+
+
+	if (di->fs == dp->obj.fs && di->id == dp->obj.fs->id && di->sclust == dp->obj.sclust) {
+		if (dp->dptr / SZDIRE + 1 - n_ent < di->nent) {
+			di->fs = 0;		/* Indexed entries are reused, discard the index */
+		} else {
+			if (di->stat == 1) di->stat = 0;	/* The object follows the index, index it later */
+		}
+	}
+}
+#endif
+#endif	/* FF_FS_DIR_INDEX */
 
 
 
@@ -2355,10 +3134,8 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 )
 {
 	FRESULT res;
+#if FF_FS_EXFAT
 	FATFS *fs = dp->obj.fs;
-	BYTE c;
-#if FF_USE_LFN
-	BYTE a, ord, sum;
 #endif
 
 	res = dir_sdi(dp, 0);			/* Rewind directory object */
@@ -2384,45 +3161,169 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	}
 #endif
 	/* On the FAT/FAT32 volume */
+#if FF_FS_DIR_INDEX
+	return find_index(dp);
+#else
+	return match_name(dp, 0xFFFFFFFF, 0);
+#endif
+}
+
+
+
+
+#if FF_FS_PATH_CACHE
+/*-----------------------------------------------------------------------*/
+/* Path cache - Discard all entries                                      */
+/*-----------------------------------------------------------------------*/
+
+static void clear_pcache (
+	FATFS* fs			/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	fs->pc_tick = 0;
+	for (i = 0; i < FF_FS_PATH_CACHE; i++) fs->pc[i].age = 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Path cache - Find the segment name in the path cache                  */
+/*-----------------------------------------------------------------------*/
+
+static int find_pcache (	/* Returns index of the entry (-1:not in the cache) */
+	DIR* dp					/* Directory object with the segment name */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	PATHCACHE *pc;
+	UINT i;
 #if FF_USE_LFN
-	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+	UINT n;
 #endif
-	do {
-		res = move_window(fs, dp->sect);
-		if (res != FR_OK) break;
-		c = dp->dir[DIR_Name];
-		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
-#if FF_USE_LFN		/* LFN configuration */
-		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
-		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
-			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-		} else {
-			if (a == AM_LFN) {			/* An LFN entry is found */
-				if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
-					if (c & LLEF) {		/* Is it start of LFN sequence? */
-						sum = dp->dir[LDIR_Chksum];
-						c &= (BYTE)~LLEF; ord = c;	/* LFN start order */
-						dp->blk_ofs = dp->dptr;	/* Start offset of LFN */
-					}
-					/* Check validity of the LFN entry and compare it with given name */
-					ord = (c == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
-				}
-			} else {					/* An SFN entry is found */
-				if (ord == 0 && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
-				if (!(dp->fn[NSFLAG] & NS_LOSS) && !memcmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
-				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-			}
+
+
+	if (dp->fn[NSFLAG] & NS_DOT) return -1;	/* Dot names are not cached */
+	for (i = 0; i < FF_FS_PATH_CACHE; i++) {
+		pc = &fs->pc[i];
+		if (pc->age == 0 || pc->dclust != dp->obj.sclust) continue;	/* Blank or in another directory? */
+#if FF_USE_LFN
+		for (n = 0; pc->name[n] && pc->name[n] == ff_wtoupper(fs->lfnbuf[n]); n++) ;	/* Compare the name (case insensitive) */
+		if (pc->name[n] || fs->lfnbuf[n]) continue;
+#else
+		if (memcmp(pc->name, dp->fn, 11)) continue;
+#endif
+		pc->age = ++fs->pc_tick;
+		return (int)i;
+	}
+	return -1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Path cache - Add the object found by dir_find()                       */
+/*-----------------------------------------------------------------------*/
+
+static void put_pcache (
+	DIR* dp					/* Directory object pointing the object found */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	PATHCACHE *pc = fs->pc;
+	UINT i;
+#if FF_USE_LFN
+	UINT n;
+#endif
+
+
+	if (dp->fn[NSFLAG] & NS_DOT) return;	/* Dot names are not cached */
+#if FF_USE_LFN
+	for (n = 0; fs->lfnbuf[n]; n++) ;
+	if (n >= sizeof pc->name / sizeof pc->name[0]) return;	/* Too long name to be cached */
+#endif
+	for (i = 1; i < FF_FS_PATH_CACHE; i++) {	/* Replace the least recently used entry */
+		if (fs->pc[i].age < pc->age) pc = &fs->pc[i];
+	}
+	pc->age = ++fs->pc_tick;
+	pc->dclust = dp->obj.sclust;
+	pc->dptr = dp->dptr;
+#if FF_USE_LFN
+	pc->blk_ofs = dp->blk_ofs;
+	for (n = 0; (pc->name[n] = (WCHAR)ff_wtoupper(fs->lfnbuf[n])) != 0; n++) ;
+#else
+	memcpy(pc->name, dp->fn, 11);
+#endif
+	pc->attr = dp->obj.attr;
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		pc->sclust = ld_dword(fs->dirbuf + XDIR_FstClus);
+		pc->objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
+		pc->stat = fs->dirbuf[XDIR_GenFlags] & 2;
+	} else
+#endif
+	{
+		pc->sclust = ld_clust(fs, dp->dir);
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Path cache - Open the sub-directory or load the object in the cache   */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT use_pcache (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp,				/* Directory object with the segment name */
+	int i					/* Index of the path cache entry */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	PATHCACHE *pc = &fs->pc[i];
+
+
+	if (!(dp->fn[NSFLAG] & NS_LAST)) {	/* A sub-directory on the path */
+		if (!(pc->attr & AM_DIR)) return FR_NO_PATH;	/* It is not a sub-directory and cannot follow */
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* Save containing directory information for next dir */
+			dp->obj.c_scl = dp->obj.sclust;
+			dp->obj.c_size = ((DWORD)dp->obj.objsize & 0xFFFFFF00) | dp->obj.stat;
+			dp->obj.c_ofs = pc->blk_ofs;
+			dp->obj.objsize = pc->objsize;
+			dp->obj.stat = pc->stat;
+			dp->obj.n_frag = 0;
 		}
-#else		/* Non LFN configuration */
-		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
-		if (!(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
 #endif
-		res = dir_next(dp, 0);	/* Next entry */
-	} while (res == FR_OK);
+		dp->obj.sclust = pc->sclust;	/* Open next directory */
+		return FR_OK;
+	}
 
-	return res;
+	/* The last segment: load the entry as dir_find() does */
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		res = dir_sdi(dp, pc->blk_ofs);
+		if (res != FR_OK) return res;
+		dp->blk_ofs = pc->blk_ofs;
+		res = load_xdir(dp);
+		if (res == FR_OK) dp->obj.attr = fs->dirbuf[XDIR_Attr] & AM_MASK;
+		return res;
+	}
+#endif
+	res = dir_sdi(dp, pc->dptr);
+	if (res == FR_OK) res = move_window(fs, dp->sect);
+	if (res != FR_OK) return res;
+#if FF_USE_LFN
+	dp->blk_ofs = pc->blk_ofs;
+#endif
+	dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+	return FR_OK;
 }
 
+#endif	/* FF_FS_PATH_CACHE */
+
 
 
 
@@ -2443,6 +3344,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 
 
 	if (dp->fn[NSFLAG] & (NS_DOT | NS_NONAME)) return FR_INVALID_NAME;	/* Check name validity */
+#if FF_FS_PATH_CACHE
+	clear_pcache(fs);	/* The directory is going to be changed */
+#endif
 	for (len = 0; fs->lfnbuf[len]; len++) ;	/* Get lfn length */
 
 #if FF_FS_EXFAT
@@ -2493,6 +3397,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	/* Create an SFN with/without LFNs. */
 	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
 	res = dir_alloc(dp, n_ent);		/* Allocate entries */
+#if FF_FS_DIR_INDEX
+	if (res == FR_OK) alloc_index(dp, n_ent);
+#endif
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
 		if (res == FR_OK) {
@@ -2508,7 +3415,13 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	}
 
 #else	/* Non LFN configuration */
+#if FF_FS_PATH_CACHE
+	clear_pcache(fs);	/* The directory is going to be changed */
+#endif
 	res = dir_alloc(dp, 1);		/* Allocate an entry for SFN */
+#if FF_FS_DIR_INDEX
+	if (res == FR_OK) alloc_index(dp, 1);
+#endif
 
 #endif
 
@@ -2545,7 +3458,12 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 	FATFS *fs = dp->obj.fs;
 #if FF_USE_LFN		/* LFN configuration */
 	DWORD last = dp->dptr;
+#endif
 
+#if FF_FS_PATH_CACHE
+	clear_pcache(fs);	/* The directory is going to be changed */
+#endif
+#if FF_USE_LFN
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -3008,6 +3926,9 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	FRESULT res;
 	BYTE ns;
 	FATFS *fs = dp->obj.fs;
+#if FF_FS_PATH_CACHE
+	int i;
+#endif
 
 
 #if FF_FS_RPATH != 0
@@ -3044,6 +3965,14 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		for (;;) {
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if FF_FS_PATH_CACHE
+			i = find_pcache(dp);			/* Find the segment name in the path cache */
+			if (i >= 0) {
+				res = use_pcache(dp, i);
+				if (res != FR_OK || (dp->fn[NSFLAG] & NS_LAST)) break;
+				continue;
+			}
+#endif
 			res = dir_find(dp);				/* Find an object with the segment name */
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
@@ -3058,6 +3987,9 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 				}
 				break;
 			}
+#if FF_FS_PATH_CACHE
+			put_pcache(dp);					/* Remember the object found */
+#endif
 			if (ns & NS_LAST) break;		/* Last segment matched. Function completed. */
 			/* Get into the sub-directory */
 			if (!(dp->obj.attr & AM_DIR)) {	/* It is not a sub-directory and cannot follow */
@@ -3373,6 +4305,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 	fs->fs_type = 0;					/* Clear the filesystem object */
 	fs->pdrv = LD2PD(vol);				/* Volume hosting physical drive */
+#if FF_FS_WINCACHE && !FF_FS_READONLY
+	fs->wc_n = 0;						/* Do not cache windows until the volume is mounted */
+#endif
 	stat = disk_initialize(fs->pdrv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
@@ -3452,6 +4387,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->bm_run_ncl = 0;
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3536,6 +4472,22 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type */
 	fs->id = ++Fsid;		/* Volume mount ID */
+#if FF_FS_FREE_SCAN && !FF_FS_READONLY
+	fs->scan_clst = 0;		/* Free clusters are not counted yet */
+#endif
+#if FF_FS_FREE_MAP && !FF_FS_READONLY
+	init_fmap(fs);
+#endif
+#if FF_FS_WINCACHE && !FF_FS_READONLY
+	init_wcache(fs);
+#endif
+#if FF_FS_MIRROR_DEFER && !FF_FS_READONLY
+	fs->mir_lo = fs->mir_hi = 0;	/* No FAT sector to be mirrored */
+	memset(fs->mir_map, 0, sizeof fs->mir_map);
+#endif
+#if FF_FS_PATH_CACHE
+	clear_pcache(fs);
+#endif
 #if FF_USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if FF_FS_EXFAT
@@ -3625,6 +4577,9 @@ FRESULT f_mount (
 #endif
 #if FF_FS_REENTRANT						/* Discard sync object of the current volume */
 		if (!ff_del_syncobj(cfs->sobj)) return FR_INT_ERR;
+#endif
+#if FF_FS_DIR_INDEX
+		if (DirIdx[vol % N_DIRIDX].fs == cfs) DirIdx[vol % N_DIRIDX].fs = 0;	/* Discard the directory index of the volume */
 #endif
 		cfs->fs_type = 0;				/* Clear old fs object */
 	}
@@ -3835,6 +4790,9 @@ FRESULT f_open (
 		FREE_NAMBUF();
 	}
 
+#if FF_USE_FASTSEEK && FF_CLMT_POOL_TABLES
+	if (res == FR_OK) auto_clmt(fp);	/* Map a large read-only file for fast seek */
+#endif
 	if (res != FR_OK) fp->obj.fs = 0;	/* Invalidate file object on error */
 
 	LEAVE_FF(fs, res);
@@ -4156,6 +5114,13 @@ FRESULT f_close (
 	FRESULT res;
 	FATFS *fs;
 
+#if FF_USE_FASTSEEK && FF_CLMT_POOL_TABLES
+	if (fp->obj.fs && fp->pooltbl) {	/* Return the table f_open() took from the pool */
+		if (fp->cltbl == fp->pooltbl) fp->cltbl = 0;
+		ff_clmt_free(fp->pooltbl);
+		fp->pooltbl = 0;
+	}
+#endif
 #if !FF_FS_READONLY
 	res = f_sync(fp);					/* Flush cached data */
 	if (res == FR_OK)
@@ -4375,8 +5340,6 @@ FRESULT f_lseek (
 	LBA_t nsect;
 	FSIZE_t ifptr;
 #if FF_USE_FASTSEEK
-	DWORD cl, pcl, ncl, tcl, tlen, ulen;
-	DWORD *tbl;
 	LBA_t dsc;
 #endif
 
@@ -4392,30 +5355,8 @@ FRESULT f_lseek (
 #if FF_USE_FASTSEEK
 	if (fp->cltbl) {	/* Fast seek */
 		if (ofs == CREATE_LINKMAP) {	/* Create CLMT */
-			tbl = fp->cltbl;
-			tlen = *tbl++; ulen = 2;	/* Given table size and required table size */
-			cl = fp->obj.sclust;		/* Origin of the chain */
-			if (cl != 0) {
-				do {
-					/* Get a fragment */
-					tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
-					do {
-						pcl = cl; ncl++;
-						cl = get_fat(&fp->obj, cl);
-						if (cl <= 1) ABORT(fs, FR_INT_ERR);
-						if (cl == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
-					} while (cl == pcl + 1);
-					if (ulen <= tlen) {		/* Store the length and top of the fragment */
-						*tbl++ = ncl; *tbl++ = tcl;
-					}
-				} while (cl < fs->n_fatent);	/* Repeat until end of chain */
-			}
-			*fp->cltbl = ulen;	/* Number of items used */
-			if (ulen <= tlen) {
-				*tbl = 0;		/* Terminate table */
-			} else {
-				res = FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
-			}
+			res = create_clmt(fp);
+			if (res == FR_INT_ERR || res == FR_DISK_ERR) ABORT(fs, res);
 		} else {						/* Fast seek */
 			if (ofs > fp->obj.objsize) ofs = fp->obj.objsize;	/* Clip offset at the file size */
 			fp->fptr = ofs;				/* Set file pointer */
@@ -4755,10 +5696,12 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
+#if !FF_FS_FREE_SCAN
 	DWORD nfree, clst, stat;
 	LBA_t sect;
 	UINT i;
 	FFOBJID obj;
+#endif
 
 
 	/* Get logical drive */
@@ -4769,6 +5712,11 @@ FRESULT f_getfree (
 		if (fs->free_clst <= fs->n_fatent - 2) {
 			*nclst = fs->free_clst;
 		} else {
+#if FF_FS_FREE_SCAN
+			/* Complete the free cluster scan to obtain number of free clusters */
+			res = scan_free(fs, 0);
+			if (res == FR_OK) *nclst = fs->free_clst;
+#else
 			/* Scan FAT to obtain number of free clusters */
 			nfree = 0;
 			if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
@@ -4826,6 +5774,7 @@ FRESULT f_getfree (
 				fs->free_clst = nfree;	/* Now free_clst is valid */
 				fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
 			}
+#endif
 		}
 	}
 
@@ -4835,6 +5784,43 @@ FRESULT f_getfree (
 
 
 
+#if FF_FS_FREE_SCAN
+/*-----------------------------------------------------------------------*/
+/* Count Free Clusters in the Background                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_scanfree (
+	const TCHAR* path,	/* Logical drive number */
+	UINT nsect			/* Number of FAT sectors to scan in this call */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	int vol;
+
+
+	/* Get logical drive, but do not mount it here */
+	vol = get_ldnumber(&path);
+	if (vol < 0) return FR_INVALID_DRIVE;
+	fs = FatFs[vol];
+	if (!fs) return FR_NOT_ENABLED;
+#if FF_FS_REENTRANT
+	if (!lock_fs(fs)) return FR_TIMEOUT;
+#endif
+	if (fs->fs_type == 0 || (disk_status(fs->pdrv) & STA_NOINIT)) {
+		res = FR_NOT_READY;		/* Not mounted yet */
+	} else {
+		res = scan_free(fs, nsect);
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+#endif	/* FF_FS_FREE_SCAN */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -5528,6 +6514,17 @@ FRESULT f_expand (
 	{
 		scl = clst = stcl; ncl = 0;
 		for (;;) {	/* Find a contiguous cluster block */
+#if FF_FS_FREE_MAP
+			if (!test_fmap(fs, clst)) {	/* Skip the group if it has no free cluster */
+				n = (clst | ((1UL << fs->fmap_shift) - 1)) + 1;	/* Top of next group */
+				if (n >= fs->n_fatent) n = 2;
+				if (n > clst ? (stcl > clst && stcl <= n) : (stcl > clst || stcl <= n)) {	/* Passed the start cluster? */
+					res = FR_DENIED; break;
+				}
+				scl = clst = n; ncl = 0;
+				continue;
+			}
+#endif
 			n = get_fat(&fp->obj, clst);
 			if (++clst >= fs->n_fatent) clst = 2;
 			if (n == 1) { res = FR_INT_ERR; break; }
@@ -5563,6 +6560,11 @@ FRESULT f_expand (
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+#if FF_FS_FREE_SCAN
+			if (scl < fs->scan_clst) {	/* Some clusters are already checked by the free cluster scan? */
+				fs->scan_free -= (fs->scan_clst - scl < tcl) ? fs->scan_clst - scl : tcl;
+			}
+#endif
 		}
 	}
 
@@ -127,6 +127,30 @@ extern const char* VolumeStr[FF_VOLUMES];	/* User defied volume ID */
 
 
 
+/* Path cache entry (PATHCACHE) */
+
+#if FF_FS_PATH_CACHE
+typedef struct {
+	DWORD	age;			/* Time of the last use (0:blank) */
+	DWORD	dclust;			/* Start cluster of the containing directory (0:root) */
+	DWORD	dptr;			/* Offset of the object's entry in the containing directory */
+#if FF_USE_LFN
+	DWORD	blk_ofs;		/* Offset of the object's entry block (0xFFFFFFFF:no LFN) */
+	WCHAR	name[16];		/* Up-cased segment name (null terminated) */
+#else
+	BYTE	name[11];		/* Segment name in SFN format */
+#endif
+	BYTE	attr;			/* Object attribute */
+	DWORD	sclust;			/* Object data start cluster */
+#if FF_FS_EXFAT
+	BYTE	stat;			/* Object chain status */
+	FSIZE_t	objsize;		/* Object size */
+#endif
+} PATHCACHE;
+#endif
+
+
+
 /* Filesystem object structure (FATFS) */
 
 typedef struct {
@@ -153,6 +177,20 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if FF_FS_EXFAT
+	DWORD	bm_run_clst;	/* First cluster of a run known to be free on the allocation bitmap */
+	DWORD	bm_run_ncl;		/* Number of clusters in the free run (0:unknown) */
+	BYTE	bm_run_lead;	/* The cluster just before the free run is in use */
+#endif
+#if FF_FS_FREE_SCAN
+	DWORD	scan_clst;		/* Next cluster the free cluster scan checks (0:not started, 0xFFFFFFFF:completed) */
+	DWORD	scan_free;		/* Free clusters found below scan_clst */
+#endif
+#if FF_FS_FREE_MAP
+	BYTE	fmap_shift;		/* Number of clusters per free map bit (log2) */
+	BYTE	fmap_free;		/* A free cluster is found in the group being scanned */
+	BYTE	fmap[FF_FS_FREE_MAP];	/* Free map (bit=0:group has no free cluster, 1:group may have free clusters) */
+#endif
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -161,6 +199,10 @@ typedef struct {
 	DWORD	cdc_size;		/* b31-b8:Size of containing directory, b7-b0: Chain status */
 	DWORD	cdc_ofs;		/* Offset in the containing directory (invalid when cdir is 0) */
 #endif
+#endif
+#if FF_FS_PATH_CACHE
+	DWORD	pc_tick;		/* Time of the last path cache use */
+	PATHCACHE	pc[FF_FS_PATH_CACHE];	/* Path cache */
 #endif
 	DWORD	n_fatent;		/* Number of FAT entries (number of clusters + 2) */
 	DWORD	fsize;			/* Size of an FAT [sectors] */
@@ -172,6 +214,20 @@ typedef struct {
 	LBA_t	bitbase;		/* Allocation bitmap base sector */
 #endif
 	LBA_t	winsect;		/* Current sector appearing in the win[] */
+#if FF_FS_MIRROR_DEFER && !FF_FS_READONLY
+	DWORD	mir_lo;			/* Top of the FAT sectors to be mirrored (offset from fatbase) */
+	DWORD	mir_hi;			/* End of the FAT sectors to be mirrored (mir_lo == mir_hi:none) */
+	BYTE	mir_map[(FF_FS_MIRROR_DEFER + 7) / 8];	/* Bitmap of the FAT sectors to be mirrored from mir_lo */
+#endif
+#if FF_FS_WINCACHE && !FF_FS_READONLY
+	BYTE	wc_n;			/* Number of cached windows */
+	BYTE	wc_nfat;		/* Number of cached windows for FAT sectors (the rest is for other sectors) */
+	BYTE	wc_flag[FF_FS_WINCACHE];	/* Cached window flags (b0:dirty) */
+	DWORD	wc_tick;		/* Time of the last window moved out of win[] */
+	DWORD	wc_age[FF_FS_WINCACHE];		/* Time each cached window was moved out of win[] (0:empty) */
+	LBA_t	wc_sect[FF_FS_WINCACHE];	/* Sector in each cached window */
+	BYTE	wc_buf[FF_FS_WINCACHE * FF_MIN_SS];	/* Cached windows */
+#endif
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
 } FATFS;
 
@@ -215,6 +271,9 @@ typedef struct {
 #endif
 #if FF_USE_FASTSEEK
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (nulled on open, set by application) */
+#if FF_CLMT_POOL_TABLES
+	DWORD*	pooltbl;		/* Pointer to the table f_open() took from the CLMT pool (null:none) */
+#endif
 #endif
 #if !FF_FS_TINY
 	BYTE	buf[FF_MAX_SS];	/* File private data read/write window */
@@ -327,6 +386,7 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_scanfree (const TCHAR* path, UINT nsect);				/* Count free clusters in the background */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const LBA_t ptbl[], void* work);		/* Divide a physical drive into some partitions */
@@ -367,6 +427,12 @@ void* ff_memalloc (UINT msize);			/* Allocate memory block */
 void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 
+/* Cluster link map table pool */
+#if FF_USE_FASTSEEK && FF_CLMT_POOL_TABLES
+DWORD* ff_clmt_alloc (void);			/* Allocate a table of FF_CLMT_TABLE_ITEMS items */
+void ff_clmt_free (DWORD* tbl);			/* Free a table */
+#endif
+
 /* Sync functions */
 #if FF_FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, FF_SYNC_t* sobj);	/* Create a sync object */
@@ -34,11 +34,22 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_CLMT_POOL_TABLES	4
+#define FF_CLMT_TABLE_ITEMS	64
+#define FF_CLMT_AUTO_SIZE	0x100000
+/* When FF_USE_FASTSEEK == 1 and FF_CLMT_POOL_TABLES > 0, f_open() gives a file that is
+/  opened without FA_WRITE and is at least FF_CLMT_AUTO_SIZE bytes a cluster link map
+/  table from a pool of FF_CLMT_POOL_TABLES tables of FF_CLMT_TABLE_ITEMS items each,
+/  and f_close() returns it. A table maps up to (FF_CLMT_TABLE_ITEMS - 2) / 2 fragments.
+/  A file that is more fragmented than that, or opened while the pool is empty, follows
+/  the FAT chain as usual. ff_clmt_alloc() and ff_clmt_free() in ffsystem.c manage the pool. */
+
+
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -52,7 +63,7 @@
 /  (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FORWARD	0
+#define FF_USE_FORWARD	1
 /* This option switches f_forward() function. (0:Disable or 1:Enable) */
 
 
@@ -113,7 +124,7 @@
 */
 
 
-#define FF_USE_LFN		1
+#define FF_USE_LFN		3
 #define FF_MAX_LFN		255
 /* The FF_USE_LFN switches the support for LFN (long file name).
 /
@@ -194,7 +205,7 @@
 
 
 #define FF_MIN_SS		512
-#define FF_MAX_SS		512
+#define FF_MAX_SS		4096
 /* This set of options configures the range of sector size to be supported. (512,
 /  1024, 2048 or 4096) Always set both 512 for most systems, generic memory card and
 /  harddisk, but a larger value may be required for on-board flash memory and some
@@ -203,7 +214,7 @@
 /  GET_SECTOR_SIZE command. */
 
 
-#define FF_LBA64		0
+#define FF_LBA64		1
 /* This option switches support for 64-bit LBA. (0:Disable or 1:Enable)
 /  To enable the 64-bit LBA, also exFAT needs to be enabled. (FF_FS_EXFAT == 1) */
 
@@ -213,7 +224,7 @@
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -231,7 +242,7 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
-#define FF_FS_EXFAT		0
+#define FF_FS_EXFAT		1
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
@@ -263,6 +274,78 @@
 */
 
 
+#define FF_FS_FREE_SCAN	1
+/* The option FF_FS_FREE_SCAN switches the incremental free cluster scan. When it
+/  is 1, f_scanfree() function counts the free clusters a few FAT sectors at a
+/  time, so the application can verify the count in the FSINFO, or obtain it on a
+/  FAT12/16/exFAT volume, in the background after the volume is mounted. Clusters
+/  allocated or removed while the scan is in progress are accounted for, and once
+/  the scan is completed f_getfree() will never scan the FAT.
+/  This option has no effect in read-only configuration (FF_FS_READONLY = 1). */
+
+
+#define FF_FS_FREE_MAP	1024
+/* The option FF_FS_FREE_MAP defines the size of the free map in bytes, 0 disables
+/  it. The free map is a bitmap in the filesystem object that tells which groups
+/  of clusters on a FAT12/16/32 volume have no free cluster, so cluster allocation
+/  and f_expand() skip over them without reading the FAT. Each bit covers as few
+/  clusters as the size allows. A group is learned full when the allocator or the
+/  free cluster scan (FF_FS_FREE_SCAN) reads all of it, and is marked again when a
+/  cluster in it is removed. exFAT volumes use the allocation bitmap instead.
+/  This option has no effect in read-only configuration (FF_FS_READONLY = 1). */
+
+
+#define FF_FS_WINCACHE	4
+/* The option FF_FS_WINCACHE defines the size of the window cache in number of
+/  FF_MIN_SS sectors, 0 disables it. The window cache keeps sectors that moved out
+/  of the disk access window (FATFS::win[]) in memory, so alternating between the
+/  FAT and a directory does not write back and reload the window every time. One
+/  half of the cached windows holds FAT sectors and the other half holds directory
+/  and other sectors, and each half is replaced in least recently used order. A
+/  volume with larger sectors gets fewer cached windows. Dirty cached windows are
+/  written back when the filesystem is synchronized (f_sync(), f_close() and so on).
+/  This option must be 0 when FF_FS_TINY is 1 and has no effect in read-only
+/  configuration (FF_FS_READONLY = 1). */
+
+
+#define FF_FS_MIRROR_DEFER	64
+/* The option FF_FS_MIRROR_DEFER defers the writes to the second FAT on volumes
+/  with two FATs. When it is 0, every FAT sector written to the first FAT is also
+/  written to the second FAT at the same time. When it is >0, the FAT sectors written
+/  are marked in a bitmap and copied from the first FAT to the second FAT in one
+/  ascending pass when the filesystem is synchronized (f_sync(), f_close() and so on).
+/  The value is the span of FAT sectors the bitmap covers; a FAT sector farther from
+/  the marked sectors is mirrored at once.
+/  The first FAT is always up to date, so the second FAT may be stale only if the
+/  volume is removed without being synchronized. This option has no effect in
+/  read-only configuration (FF_FS_READONLY = 1). */
+
+
+#define FF_FS_DIR_INDEX	16384
+/* The option FF_FS_DIR_INDEX defines the size of the directory index in bytes, 0
+/  disables it. The directory index keeps a one-byte hash of the long name and of
+/  the short name of each object in the last directory searched on a FAT12/16/32
+/  volume, and the number of objects starting in each of its sectors. Searching the
+/  directory again reads only the sectors where an object may have the name. The
+/  index is filled as the directory is searched, so it needs no extra reads. It
+/  takes about two bytes per object and one byte per directory sector. Objects
+/  that do not fit in the index are searched sequentially. exFAT volumes keep name
+/  hashes in the directory entries and do not use the index. In re-entrant
+/  configuration (FF_FS_REENTRANT = 1), each volume gets an equal part of the
+/  index under its own lock. */
+
+
+#define FF_FS_PATH_CACHE	16
+/* The option FF_FS_PATH_CACHE defines the number of path segments each volume
+/  remembers, 0 disables it. Each time a path is followed, the segments found are
+/  kept in the path cache with the directory they are in and the location of their
+/  entry, and the least recently used segment is replaced. A sub-directory in the
+/  cache is entered without reading its entry, and a file in the cache is loaded
+/  without searching the directory. Segment names longer than 15 characters are
+/  not cached. The whole path cache of the volume is discarded when an object is
+/  created, removed or renamed on it. */
+
+
 #define FF_FS_LOCK		0
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
@@ -275,10 +358,12 @@
 /      lock control is independent of re-entrancy. */
 
 
-/* #include <somertos.h>	// O/S definitions */
-#define FF_FS_REENTRANT	0
-#define FF_FS_TIMEOUT	1000
-#define FF_SYNC_t		HANDLE
+#define FF_FS_REENTRANT	1
+#define FF_FS_TIMEOUT	5000
+#define FF_SYNC_t		recursive_mutex_t*
+#if FF_FS_REENTRANT
+#include "pico/mutex.h"	/* pico-sdk mutexes */
+#endif
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -294,7 +379,11 @@
 /  The FF_FS_TIMEOUT defines timeout period in unit of time tick.
 /  The FF_SYNC_t defines O/S dependent sync object type. e.g. HANDLE, ID, OS_EVENT*,
 /  SemaphoreHandle_t and etc. A header file for O/S definitions needs to be
-/  included somewhere in the scope of ff.h. */
+/  included somewhere in the scope of ff.h.
+/
+/  In this project, ffsystem.c gives each volume a pico-sdk recursive mutex so
+/  both RP2040 cores can use FatFs, and FF_FS_TIMEOUT is in milliseconds. The LFN
+/  working buffer must not be static (FF_USE_LFN = 2 or 3) in this configuration. */
 
 
 
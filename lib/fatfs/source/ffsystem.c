@@ -8,6 +8,7 @@
 
 
 #if FF_USE_LFN == 3	/* Dynamic memory allocation */
+#include <stdlib.h>
 
 /*------------------------------------------------------------------------*/
 /* Allocate a memory block                                                */
@@ -36,6 +37,67 @@ void ff_memfree (
 
 
 
+#if FF_USE_FASTSEEK && FF_CLMT_POOL_TABLES	/* Cluster link map table pool */
+
+static DWORD ClmtPool[FF_CLMT_POOL_TABLES][FF_CLMT_TABLE_ITEMS];
+static BYTE ClmtUsed[FF_CLMT_POOL_TABLES];
+#if FF_FS_REENTRANT
+auto_init_mutex(ClmtMutex);	/* The pool is shared by the volumes */
+#endif
+
+/*------------------------------------------------------------------------*/
+/* Allocate a cluster link map table                                      */
+/*------------------------------------------------------------------------*/
+
+DWORD* ff_clmt_alloc (void)	/* Returns pointer to a table of FF_CLMT_TABLE_ITEMS items (null if the pool is empty) */
+{
+	UINT i;
+	DWORD* tbl = 0;
+
+
+#if FF_FS_REENTRANT
+	mutex_enter_blocking(&ClmtMutex);
+#endif
+	for (i = 0; i < FF_CLMT_POOL_TABLES; i++) {
+		if (!ClmtUsed[i]) {
+			ClmtUsed[i] = 1;
+			tbl = ClmtPool[i];
+			break;
+		}
+	}
+#if FF_FS_REENTRANT
+	mutex_exit(&ClmtMutex);
+#endif
+	return tbl;
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Free a cluster link map table                                          */
+/*------------------------------------------------------------------------*/
+
+void ff_clmt_free (
+	DWORD* tbl		/* Pointer to the table to free (nothing to do if null or not from the pool) */
+)
+{
+	UINT i;
+
+
+#if FF_FS_REENTRANT
+	mutex_enter_blocking(&ClmtMutex);
+#endif
+	for (i = 0; i < FF_CLMT_POOL_TABLES; i++) {
+		if (tbl == ClmtPool[i]) ClmtUsed[i] = 0;
+	}
+#if FF_FS_REENTRANT
+	mutex_exit(&ClmtMutex);
+#endif
+}
+
+#endif
+
+
+
 #if FF_FS_REENTRANT	/* Mutal exclusion */
 
 /*------------------------------------------------------------------------*/
@@ -46,7 +108,9 @@ void ff_memfree (
 /  When a 0 is returned, the f_mount() function fails with FR_INT_ERR.
 */
 
-//const osMutexDef_t Mutex[FF_VOLUMES];	/* Table of CMSIS-RTOS mutex */
+#include "diskio.h"	/* msc_fat_mutex_enter() */
+
+static recursive_mutex_t Mutex[FF_VOLUMES];	/* Table of pico-sdk recursive mutexes */
 
 
 int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object */
@@ -54,27 +118,11 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object
 	FF_SYNC_t* sobj		/* Pointer to return the created sync object */
 )
 {
-	/* Win32 */
-	*sobj = CreateMutex(NULL, FALSE, NULL);
-	return (int)(*sobj != INVALID_HANDLE_VALUE);
-
-	/* uITRON */
-//	T_CSEM csem = {TA_TPRI,1,1};
-//	*sobj = acre_sem(&csem);
-//	return (int)(*sobj > 0);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	*sobj = OSMutexCreate(0, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	*sobj = xSemaphoreCreateMutex();
-//	return (int)(*sobj != NULL);
-
-	/* CMSIS-RTOS */
-//	*sobj = osMutexCreate(&Mutex[vol]);
-//	return (int)(*sobj != NULL);
+	/* pico-sdk; the mutex is kept for the next mount of the volume, so it is
+	   never initialized again while the other core may be holding it */
+	if (!recursive_mutex_is_initialized(&Mutex[vol])) recursive_mutex_init(&Mutex[vol]);
+	*sobj = &Mutex[vol];
+	return 1;
 }
 
 
@@ -90,23 +138,9 @@ int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to an error
 	FF_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	/* Win32 */
-	return (int)CloseHandle(sobj);
-
-	/* uITRON */
-//	return (int)(del_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexDel(sobj, OS_DEL_ALWAYS, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//  vSemaphoreDelete(sobj);
-//	return 1;
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexDelete(sobj) == osOK);
+	/* pico-sdk */
+	(void)sobj;
+	return 1;
 }
 
 
@@ -121,22 +155,8 @@ int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a gran
 	FF_SYNC_t sobj	/* Sync object to wait */
 )
 {
-	/* Win32 */
-	return (int)(WaitForSingleObject(sobj, FF_FS_TIMEOUT) == WAIT_OBJECT_0);
-
-	/* uITRON */
-//	return (int)(wai_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexPend(sobj, FF_FS_TIMEOUT, &err));
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	return (int)(xSemaphoreTake(sobj, FF_FS_TIMEOUT) == pdTRUE);
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexWait(sobj, FF_FS_TIMEOUT) == osOK);
+	/* pico-sdk; on the USB core, the USB host stack runs while waiting */
+	return (int)msc_fat_mutex_enter(sobj, FF_FS_TIMEOUT);
 }
 
 
@@ -150,20 +170,8 @@ void ff_rel_grant (
 	FF_SYNC_t sobj	/* Sync object to be signaled */
 )
 {
-	/* Win32 */
-	ReleaseMutex(sobj);
-
-	/* uITRON */
-//	sig_sem(sobj);
-
-	/* uC/OS-II */
-//	OSMutexPost(sobj);
-
-	/* FreeRTOS */
-//	xSemaphoreGive(sobj);
-
-	/* CMSIS-RTOS */
-//	osMutexRelease(sobj);
+	/* pico-sdk */
+	recursive_mutex_exit(sobj);
 }
 
 #endif
@@ -0,0 +1,262 @@
+/**
+ * @file msc-bench.c
+ * @brief measure drive throughput, IOPS and latency through FatFs
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msc-bench.h"
+#include "diskio.h"
+#include "msc-scratch.h"
+#include "pico/time.h"
+
+// bench points into the scratch buffer while a test runs
+typedef struct {
+    BYTE buf[MSC_BENCH_BUFFER_SIZE];
+    uint32_t samples[MSC_BENCH_SAMPLES];
+    FIL fil;
+} msc_bench_scratch_t;
+static_assert(sizeof(msc_bench_scratch_t) <= MSC_SCRATCH_SIZE, "the bench buffers do not fit in MSC_SCRATCH_SIZE");
+static msc_bench_scratch_t* bench;
+
+/**
+ * @brief take the scratch buffer for a test
+ *
+ * @return true if the test can run
+ */
+static bool msc_bench_start(msc_bench_result_t* result)
+{
+    memset(result, 0, sizeof(*result));
+    bench = msc_scratch_take();
+    return bench != NULL;
+}
+
+/**
+ * @brief record the latency of an operation that started at start_us
+ */
+static void msc_bench_sample(msc_bench_result_t* result, uint64_t start_us, UINT nbytes)
+{
+    uint64_t latency = time_us_64() - start_us;
+    bench->samples[result->ops % MSC_BENCH_SAMPLES] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    result->ops++;
+    result->bytes += nbytes;
+}
+
+static int msc_bench_compare(const void* a, const void* b)
+{
+    uint32_t la = *(const uint32_t*)a;
+    uint32_t lb = *(const uint32_t*)b;
+    return la < lb ? -1 : la > lb;
+}
+
+/**
+ * @brief fill in the total time and the latency percentiles, then let
+ * the next test run
+ */
+static FRESULT msc_bench_finish(msc_bench_result_t* result, uint64_t start_us, FRESULT res)
+{
+    result->elapsed_us = time_us_64() - start_us;
+    uint32_t nsamples = result->ops < MSC_BENCH_SAMPLES ? result->ops : MSC_BENCH_SAMPLES;
+    if (nsamples != 0)
+    {
+        qsort(bench->samples, nsamples, sizeof(bench->samples[0]), msc_bench_compare);
+        result->p50_us = bench->samples[(nsamples - 1) * 50 / 100];
+        result->p90_us = bench->samples[(nsamples - 1) * 90 / 100];
+        result->p99_us = bench->samples[(nsamples - 1) * 99 / 100];
+        result->max_us = bench->samples[nsamples - 1];
+    }
+    msc_scratch_give();
+    return res;
+}
+
+/**
+ * @brief the next random number of a fixed sequence (xorshift32)
+ */
+static uint32_t msc_bench_random_next(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+FRESULT msc_bench_seq_write(const TCHAR* path, FSIZE_t size, UINT xfer, msc_bench_result_t* result)
+{
+    if (!msc_bench_start(result))
+        return FR_NOT_ENOUGH_CORE;
+    if (xfer == 0 || xfer > sizeof(bench->buf))
+        return msc_bench_finish(result, time_us_64(), FR_INVALID_PARAMETER);
+    for (UINT idx = 0; idx < sizeof(bench->buf); idx++)
+        bench->buf[idx] = (BYTE)idx;
+    uint64_t start_us = time_us_64();
+    FRESULT res = f_open(&bench->fil, path, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res == FR_OK)
+    {
+        FSIZE_t offset = 0;
+        while (res == FR_OK && offset < size)
+        {
+            UINT btw = size - offset < xfer ? (UINT)(size - offset) : xfer;
+            UINT written;
+            uint64_t op_us = time_us_64();
+            res = f_write(&bench->fil, bench->buf, btw, &written);
+            msc_bench_sample(result, op_us, written);
+            if (res == FR_OK && written != btw)
+                res = FR_DENIED; // the drive is full
+            offset += written;
+        }
+        FRESULT close_res = f_close(&bench->fil);
+        if (res == FR_OK)
+            res = close_res;
+    }
+    return msc_bench_finish(result, start_us, res);
+}
+
+FRESULT msc_bench_seq_read(const TCHAR* path, UINT xfer, msc_bench_result_t* result)
+{
+    if (!msc_bench_start(result))
+        return FR_NOT_ENOUGH_CORE;
+    if (xfer == 0 || xfer > sizeof(bench->buf))
+        return msc_bench_finish(result, time_us_64(), FR_INVALID_PARAMETER);
+    uint64_t start_us = time_us_64();
+    FRESULT res = f_open(&bench->fil, path, FA_READ);
+    if (res == FR_OK)
+    {
+        UINT nread = xfer;
+        while (res == FR_OK && nread == xfer)
+        {
+            uint64_t op_us = time_us_64();
+            res = f_read(&bench->fil, bench->buf, xfer, &nread);
+            if (nread != 0)
+                msc_bench_sample(result, op_us, nread);
+        }
+        f_close(&bench->fil);
+    }
+    return msc_bench_finish(result, start_us, res);
+}
+
+FRESULT msc_bench_random(const TCHAR* path, bool write, uint32_t ops, msc_bench_result_t* result)
+{
+    if (!msc_bench_start(result))
+        return FR_NOT_ENOUGH_CORE;
+    uint64_t start_us = time_us_64();
+    FRESULT res = f_open(&bench->fil, path, write ? FA_READ | FA_WRITE : FA_READ);
+    if (res == FR_OK)
+    {
+        FSIZE_t nblocks = f_size(&bench->fil) / MSC_BENCH_RANDOM_SIZE;
+        if (nblocks == 0)
+            res = FR_INVALID_PARAMETER;
+        uint32_t seed = 0x2545F491u; // the same offsets every run
+        for (uint32_t op = 0; res == FR_OK && op < ops; op++)
+        {
+            FSIZE_t offset = (FSIZE_t)(msc_bench_random_next(&seed) % nblocks) * MSC_BENCH_RANDOM_SIZE;
+            UINT nbytes = 0;
+            uint64_t op_us = time_us_64();
+            res = f_lseek(&bench->fil, offset);
+            if (res == FR_OK)
+            {
+                if (write)
+                    res = f_write(&bench->fil, bench->buf, MSC_BENCH_RANDOM_SIZE, &nbytes);
+                else
+                    res = f_read(&bench->fil, bench->buf, MSC_BENCH_RANDOM_SIZE, &nbytes);
+            }
+            msc_bench_sample(result, op_us, nbytes);
+            if (res == FR_OK && nbytes != MSC_BENCH_RANDOM_SIZE)
+                res = FR_INT_ERR; // the file is shorter than its size
+        }
+        FRESULT close_res = f_close(&bench->fil);
+        if (res == FR_OK)
+            res = close_res;
+    }
+    return msc_bench_finish(result, start_us, res);
+}
+
+FRESULT msc_bench_metadata(const TCHAR* dir, uint32_t nfiles, msc_bench_result_t* create, msc_bench_result_t* del)
+{
+    TCHAR path[32]; // "<dir>/f<n>.tmp"
+    uint32_t created = 0;
+    memset(del, 0, sizeof(*del));
+    if (strlen(dir) + sizeof("/f4294967295.tmp") > sizeof(path))
+    {
+        memset(create, 0, sizeof(*create));
+        return FR_INVALID_NAME;
+    }
+    if (!msc_bench_start(create))
+        return FR_NOT_ENOUGH_CORE;
+    uint64_t start_us = time_us_64();
+    FRESULT res = f_mkdir(dir);
+    if (res != FR_OK)
+        return msc_bench_finish(create, start_us, res);
+    while (res == FR_OK && created < nfiles)
+    {
+        snprintf(path, sizeof(path), "%s/f%lu.tmp", dir, (unsigned long)created);
+        uint64_t op_us = time_us_64();
+        res = f_open(&bench->fil, path, FA_WRITE | FA_CREATE_NEW);
+        if (res == FR_OK)
+        {
+            res = f_close(&bench->fil);
+            created++;
+        }
+        msc_bench_sample(create, op_us, 0);
+    }
+    FRESULT create_res = msc_bench_finish(create, start_us, res);
+
+    // delete whatever was created, even if the creates failed
+    if (!msc_bench_start(del))
+        return create_res != FR_OK ? create_res : FR_NOT_ENOUGH_CORE;
+    start_us = time_us_64();
+    res = FR_OK;
+    for (uint32_t idx = 0; idx < created; idx++)
+    {
+        snprintf(path, sizeof(path), "%s/f%lu.tmp", dir, (unsigned long)idx);
+        uint64_t op_us = time_us_64();
+        FRESULT unlink_res = f_unlink(path);
+        msc_bench_sample(del, op_us, 0);
+        if (res == FR_OK)
+            res = unlink_res;
+    }
+    FRESULT rmdir_res = f_unlink(dir);
+    if (res == FR_OK)
+        res = rmdir_res;
+    res = msc_bench_finish(del, start_us, res);
+    return create_res != FR_OK ? create_res : res;
+}
+
+uint32_t msc_bench_rate_x100(const msc_bench_result_t* result)
+{
+    if (result->elapsed_us == 0)
+        return 0;
+    return (uint32_t)(result->bytes * 100 / result->elapsed_us); // bytes per us is MB/s
+}
+
+uint32_t msc_bench_iops(const msc_bench_result_t* result)
+{
+    if (result->elapsed_us == 0)
+        return 0;
+    return (uint32_t)((uint64_t)result->ops * 1000000 / result->elapsed_us);
+}
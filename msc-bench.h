@@ -0,0 +1,126 @@
+/**
+ * @file msc-bench.h
+ * @brief measure drive throughput, IOPS and latency through FatFs
+ *
+ * Each test times every operation with time_us_64() and reports the
+ * total time and the latency percentiles of the operations. The
+ * percentiles are taken over the last MSC_BENCH_SAMPLES operations of a
+ * test. The random tests pick their offsets from a fixed seed, so two
+ * firmware builds run the same sequence of operations. The buffers and
+ * the file object are kept in the msc-scratch.h buffer; a test returns
+ * FR_NOT_ENOUGH_CORE if this core already holds it.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "ff.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MSC_BENCH_BUFFER_SIZE
+#define MSC_BENCH_BUFFER_SIZE 16384 // the largest transfer size of a test
+#endif
+#ifndef MSC_BENCH_SAMPLES
+#define MSC_BENCH_SAMPLES 1024 // operation latencies kept for the percentiles
+#endif
+#define MSC_BENCH_RANDOM_SIZE 4096 // bytes per random read or write
+
+typedef struct {
+    uint32_t ops;           // operations timed
+    uint64_t bytes;         // bytes transferred; 0 for the metadata tests
+    uint64_t elapsed_us;    // the time of all operations plus the final sync, if any
+    uint32_t p50_us;        // median operation latency
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} msc_bench_result_t;
+
+/**
+ * @brief create or replace a file and write it from start to end
+ *
+ * @param path the test file
+ * @param size the file size in bytes
+ * @param xfer the bytes per f_write() call, up to MSC_BENCH_BUFFER_SIZE
+ * @param result set to the measurements; the time includes the f_close()
+ * @return FRESULT FR_OK or the first error seen
+ */
+FRESULT msc_bench_seq_write(const TCHAR* path, FSIZE_t size, UINT xfer, msc_bench_result_t* result);
+
+/**
+ * @brief read a whole file from start to end
+ *
+ * @param path the test file
+ * @param xfer the bytes per f_read() call, up to MSC_BENCH_BUFFER_SIZE
+ * @param result set to the measurements
+ * @return FRESULT FR_OK or the first error seen
+ */
+FRESULT msc_bench_seq_read(const TCHAR* path, UINT xfer, msc_bench_result_t* result);
+
+/**
+ * @brief read or overwrite MSC_BENCH_RANDOM_SIZE bytes at random aligned
+ * offsets in an existing file
+ *
+ * @param path the test file; at least MSC_BENCH_RANDOM_SIZE bytes long
+ * @param write true to write, false to read
+ * @param ops the number of operations
+ * @param result set to the measurements; the time of a write test
+ * includes the f_close()
+ * @return FRESULT FR_OK or the first error seen. FR_INVALID_PARAMETER
+ * if the file is too short.
+ */
+FRESULT msc_bench_random(const TCHAR* path, bool write, uint32_t ops, msc_bench_result_t* result);
+
+/**
+ * @brief create empty files in a new directory, then delete them
+ *
+ * Each create is an f_open() and f_close() of a new file; each delete is
+ * an f_unlink(). The directory is removed at the end.
+ *
+ * @param dir the directory to create; it must not exist and must be at
+ * most 15 characters long
+ * @param nfiles the number of files
+ * @param create set to the measurements of the creates
+ * @param del set to the measurements of the deletes
+ * @return FRESULT FR_OK or the first error seen. FR_INVALID_NAME if dir
+ * is too long.
+ */
+FRESULT msc_bench_metadata(const TCHAR* dir, uint32_t nfiles, msc_bench_result_t* create, msc_bench_result_t* del);
+
+/**
+ * @brief get the throughput in hundredths of a megabyte (10^6 bytes) per second
+ */
+uint32_t msc_bench_rate_x100(const msc_bench_result_t* result);
+
+/**
+ * @brief get the operations per second
+ */
+uint32_t msc_bench_iops(const msc_bench_result_t* result);
+
+#ifdef __cplusplus
+}
+#endif
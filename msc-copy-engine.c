@@ -0,0 +1,192 @@
+/**
+ * @file msc-copy-engine.c
+ * @brief copy files with the reads and writes overlapped
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <assert.h>
+#include <string.h>
+#include "msc-copy-engine.h"
+#include "diskio.h"
+#include "msc-scratch.h"
+#include "pico/time.h"
+
+static_assert(MSC_COPY_BUFFER_SIZE % FF_MAX_SS == 0, "MSC_COPY_BUFFER_SIZE must be a multiple of FF_MAX_SS");
+static_assert(MSC_COPY_BUFFERS >= 2, "the copy engine needs at least 2 buffers to overlap reads and writes");
+
+// copy points into the scratch buffer while a copy runs
+typedef struct {
+    BYTE buf[MSC_COPY_BUFFERS][MSC_COPY_BUFFER_SIZE];
+    msc_fat_io_t io[MSC_COPY_BUFFERS];
+    bool busy[MSC_COPY_BUFFERS];    // the buffer's write is queued
+    FIL src, dest;
+} msc_copy_scratch_t;
+static_assert(sizeof(msc_copy_scratch_t) <= MSC_SCRATCH_SIZE, "the copy buffers do not fit in MSC_SCRATCH_SIZE");
+static msc_copy_scratch_t* copy;
+
+static UINT msc_copy_ss(FATFS* fs)
+{
+#if FF_MAX_SS != FF_MIN_SS
+    return fs->ssize;
+#else
+    (void)fs;
+    return FF_MAX_SS;
+#endif
+}
+
+static void msc_copy_io_cb(msc_fat_io_t* io)
+{
+    (void)io; // the copy polls io->status
+}
+
+/**
+ * @brief wait until the buffer's write, if any, is done
+ *
+ * @return FRESULT FR_OK or FR_DISK_ERR if the write failed
+ */
+static FRESULT msc_copy_wait(int idx)
+{
+    if (!copy->busy[idx])
+        return FR_OK;
+    msc_fat_io_wait(&copy->io[idx]);
+    copy->busy[idx] = false;
+    return copy->io[idx].status == MSC_FAT_COMPLETE ? FR_OK : FR_DISK_ERR;
+}
+
+/**
+ * @brief read the source into the next free buffer while the buffers
+ * before it are written to the contiguous destination
+ */
+static FRESULT msc_copy_pipelined(FSIZE_t size, UINT chunk)
+{
+    FATFS* fs = copy->dest.obj.fs;
+    UINT ss = msc_copy_ss(fs);
+    LBA_t start_sector = fs->database + (LBA_t)fs->csize * (copy->dest.obj.sclust - 2);
+    FRESULT res = FR_OK;
+    FSIZE_t offset = 0;
+    for (int idx = 0; res == FR_OK && offset < size; idx = (idx + 1) % MSC_COPY_BUFFERS)
+    {
+        res = msc_copy_wait(idx);
+        UINT btr = size - offset < chunk ? (UINT)(size - offset) : chunk; // never past the preallocated area
+        UINT nread = 0;
+        if (res == FR_OK)
+            res = f_read(&copy->src, copy->buf[idx], btr, &nread);
+        if (res == FR_OK && nread == 0)
+            res = FR_INT_ERR; // the source is shorter than its size
+        if (res == FR_OK)
+        {
+            UINT nsect = (nread + ss - 1) / ss;
+            memset(copy->buf[idx] + nread, 0, nsect * ss - nread); // pad the last sector
+            copy->busy[idx] = msc_fat_write_async(&copy->io[idx], fs->pdrv, copy->buf[idx], start_sector + offset / ss, nsect,
+                msc_copy_io_cb, 0);
+            if (!copy->busy[idx])
+                res = FR_DISK_ERR;
+            offset += nread;
+        }
+    }
+    for (int idx = 0; idx < MSC_COPY_BUFFERS; idx++)
+    {
+        FRESULT wres = msc_copy_wait(idx);
+        if (res == FR_OK)
+            res = wres;
+    }
+    return res;
+}
+
+/**
+ * @brief copy with alternating f_read() and f_write() calls
+ */
+static FRESULT msc_copy_sequential(UINT chunk)
+{
+    FRESULT res = FR_OK;
+    UINT nread = chunk;
+    while (res == FR_OK && nread == chunk)
+    {
+        res = f_read(&copy->src, copy->buf[0], chunk, &nread);
+        if (res == FR_OK && nread != 0)
+        {
+            UINT nwritten;
+            res = f_write(&copy->dest, copy->buf[0], nread, &nwritten);
+            if (res == FR_OK && nwritten != nread)
+                res = FR_DENIED; // the destination is full
+        }
+    }
+    return res;
+}
+
+FRESULT msc_copy_file(const TCHAR* from, const TCHAR* to, msc_copy_result_t* result)
+{
+    memset(result, 0, sizeof(*result));
+    copy = msc_scratch_take();
+    if (copy == NULL)
+        return FR_NOT_ENOUGH_CORE;
+    memset(copy->busy, 0, sizeof(copy->busy));
+    uint64_t start_us = time_us_64();
+    FRESULT res = f_open(&copy->src, from, FA_READ);
+    if (res == FR_OK)
+    {
+        res = f_open(&copy->dest, to, FA_WRITE | FA_CREATE_NEW);
+        if (res == FR_OK)
+        {
+            FSIZE_t size = f_size(&copy->src);
+            // f_read() transfers at most a cluster per command; every chunk
+            // must also start on a destination sector
+            UINT chunk = (UINT)copy->src.obj.fs->csize * msc_copy_ss(copy->src.obj.fs);
+            if (chunk > MSC_COPY_BUFFER_SIZE)
+                chunk = MSC_COPY_BUFFER_SIZE;
+            if (chunk < msc_copy_ss(copy->dest.obj.fs))
+                chunk = msc_copy_ss(copy->dest.obj.fs);
+            if (size != 0)
+            {
+                if (f_expand(&copy->dest, size, 1) == FR_OK)
+                {
+                    result->pipelined = true;
+                    res = msc_copy_pipelined(size, chunk);
+                }
+                else
+                {
+                    res = msc_copy_sequential(chunk);
+                }
+            }
+            FRESULT close_res = f_close(&copy->dest);
+            if (res == FR_OK)
+                res = close_res;
+            if (res == FR_OK)
+                result->bytes = size;
+            else
+                f_unlink(to);
+        }
+        f_close(&copy->src);
+    }
+    result->elapsed_us = time_us_64() - start_us;
+    msc_scratch_give();
+    return res;
+}
+
+uint32_t msc_copy_rate_x100(const msc_copy_result_t* result)
+{
+    if (result->elapsed_us == 0)
+        return 0;
+    return (uint32_t)((uint64_t)result->bytes * 100 / result->elapsed_us); // bytes per us is MB/s
+}
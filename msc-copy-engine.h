@@ -0,0 +1,83 @@
+/**
+ * @file msc-copy-engine.h
+ * @brief copy files with the reads and writes overlapped
+ *
+ * The destination file is preallocated contiguously with f_expand(), so
+ * the data can be written straight to its sectors with
+ * msc_fat_write_async(). The source is read a cluster (or a buffer, if
+ * that is smaller) at a time with f_read(). Each read goes into the next
+ * free buffer of the pool while the writes of the buffers before it are
+ * still in flight, so the source and destination drives work at the
+ * same time. If the destination drive has no contiguous free area big
+ * enough, the file is copied with alternating f_read() and f_write()
+ * calls instead. The pool and the file objects are kept in the
+ * msc-scratch.h buffer.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "ff.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MSC_COPY_BUFFERS
+#define MSC_COPY_BUFFERS 3 // buffers in the pool; up to MSC_COPY_BUFFERS - 1 writes are in flight during a read
+#endif
+#ifndef MSC_COPY_BUFFER_SIZE
+#define MSC_COPY_BUFFER_SIZE 8192 // bytes per buffer; a multiple of FF_MAX_SS
+#endif
+
+typedef struct {
+    FSIZE_t bytes;          // bytes copied
+    uint64_t elapsed_us;    // from opening the source to closing the destination
+    bool pipelined;         // false if the destination was not contiguous and the copy was sequential
+} msc_copy_result_t;
+
+/**
+ * @brief copy a file; the destination must not exist
+ *
+ * @param from the file to copy
+ * @param to the file to create
+ * @param result set to the number of bytes copied and how long it took
+ * @return FRESULT FR_OK or the first error seen. If the copy fails after
+ * the destination was created, the destination is removed.
+ * FR_NOT_ENOUGH_CORE if this core already holds the scratch buffer.
+ */
+FRESULT msc_copy_file(const TCHAR* from, const TCHAR* to, msc_copy_result_t* result);
+
+/**
+ * @brief get the copy rate in hundredths of a megabyte (10^6 bytes) per second
+ *
+ * @param result the result of msc_copy_file()
+ * @return uint32_t the rate x 100, or 0 if the copy took no time
+ */
+uint32_t msc_copy_rate_x100(const msc_copy_result_t* result);
+
+#ifdef __cplusplus
+}
+#endif
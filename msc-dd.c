@@ -0,0 +1,136 @@
+/**
+ * @file msc-dd.c
+ * @brief time raw block reads and writes through the diskio layer
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <string.h>
+#include "msc-dd.h"
+#include "msc-scratch.h"
+#include "pico/time.h"
+
+static void msc_dd_io_cb(msc_fat_io_t* io)
+{
+    (void)io; // msc_dd() polls io->status
+}
+
+/**
+ * @brief get the drive's geometry and limit the blocks per command
+ */
+static DRESULT msc_dd_setup(BYTE pdrv, UINT blocks_per_cmd, msc_dd_result_t* result)
+{
+    if (blocks_per_cmd == 0)
+        return RES_PARERR;
+    if (disk_status(pdrv) & STA_NOINIT)
+        disk_initialize(pdrv);
+    if (disk_status(pdrv) & (STA_NODISK | STA_NOINIT))
+        return RES_NOTRDY;
+    LBA_t block_count;
+    WORD block_size;
+    DRESULT res = disk_ioctl(pdrv, GET_SECTOR_COUNT, &block_count);
+    if (res == RES_OK)
+        res = disk_ioctl(pdrv, GET_SECTOR_SIZE, &block_size);
+    if (res != RES_OK)
+        return res;
+    if (block_count == 0)
+        return RES_NOTRDY;
+    result->block_size = block_size;
+    result->last_block = block_count - 1;
+    const msc_fat_limits_t* limits = msc_fat_get_limits(pdrv);
+    UINT max_blocks = MSC_SCRATCH_SIZE / block_size;
+    if (limits != NULL && limits->max_xfer_blocks != 0 && limits->max_xfer_blocks < max_blocks)
+        max_blocks = limits->max_xfer_blocks;
+    if (max_blocks > UINT16_MAX)
+        max_blocks = UINT16_MAX; // the transfer length field of READ(10) and WRITE(10)
+    result->blocks_per_cmd = blocks_per_cmd < max_blocks ? blocks_per_cmd : max_blocks;
+    return RES_OK;
+}
+
+DRESULT msc_dd(BYTE pdrv, bool write, LBA_t start, UINT blocks_per_cmd, LBA_t nblocks, msc_dd_result_t* result)
+{
+    memset(result, 0, sizeof(*result));
+    DRESULT res = msc_dd_setup(pdrv, blocks_per_cmd, result);
+    if (res == RES_OK && (start > result->last_block || nblocks > result->last_block - start + 1))
+        res = RES_PARERR;
+    if (res != RES_OK)
+        return res;
+    BYTE* dd_buf = msc_scratch_take();
+    if (dd_buf == NULL)
+        return RES_ERROR;
+    if (write)
+    {
+        UINT nbytes = result->blocks_per_cmd * result->block_size;
+        for (UINT idx = 0; idx < nbytes; idx++)
+            dd_buf[idx] = (BYTE)idx;
+    }
+    msc_fat_lock(pdrv); // the drive's queue belongs to the holder of the lock
+    if (!write)
+        res = msc_fat_flush(pdrv); // the drive must have what the caches hold
+    // Each transfer is queued as one command, past the caches, the write
+    // combiner and the read-ahead, so the commands counted are the ones
+    // that went over USB
+    uint64_t start_us = time_us_64();
+    while (res == RES_OK && result->blocks < nblocks)
+    {
+        LBA_t remaining = nblocks - result->blocks;
+        UINT count = remaining < result->blocks_per_cmd ? (UINT)remaining : result->blocks_per_cmd;
+        LBA_t sector = start + result->blocks;
+        msc_fat_io_t io;
+        bool queued;
+        if (write)
+            queued = msc_fat_write_async(&io, pdrv, dd_buf, sector, count, msc_dd_io_cb, 0);
+        else
+            queued = msc_fat_read_async(&io, pdrv, dd_buf, sector, count, msc_dd_io_cb, 0);
+        if (!queued)
+        {
+            res = RES_NOTRDY;
+            break;
+        }
+        msc_fat_io_wait(&io);
+        if (io.status != MSC_FAT_COMPLETE)
+        {
+            res = RES_ERROR;
+            break;
+        }
+        result->blocks += count;
+        result->commands++;
+    }
+    if (write && result->blocks != 0)
+    {
+        DRESULT sync_res = msc_fat_sync(pdrv);
+        if (res == RES_OK)
+            res = sync_res;
+    }
+    result->elapsed_us = time_us_64() - start_us;
+    msc_fat_unlock(pdrv);
+    msc_scratch_give();
+    return res;
+}
+
+uint32_t msc_dd_rate_x100(const msc_dd_result_t* result)
+{
+    if (result->elapsed_us == 0)
+        return 0;
+    return (uint32_t)(result->blocks * result->block_size * 100 / result->elapsed_us); // bytes per us is MB/s
+}
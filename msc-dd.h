@@ -0,0 +1,84 @@
+/**
+ * @file msc-dd.h
+ * @brief time raw block reads and writes through the diskio layer
+ *
+ * The transfers bypass FatFs, so comparing their throughput with the
+ * bench results separates the filesystem overhead from the USB transport.
+ * Each transfer is queued with msc_fat_read_async() or
+ * msc_fat_write_async() as one SCSI command, so the diskio sector cache,
+ * write combiner and read-ahead do not change what goes over USB.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "ff.h"
+#include "diskio.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint64_t blocks;            // blocks transferred
+    uint32_t commands;          // READ or WRITE commands sent to the drive
+    UINT blocks_per_cmd;        // after limiting to the buffer and the drive
+    UINT block_size;            // bytes per block
+    uint64_t last_block;        // the drive's last LBA
+    uint64_t elapsed_us;        // including the msc_fat_sync() after writes
+} msc_dd_result_t;
+
+/**
+ * @brief read or write a range of blocks
+ *
+ * The blocks per command are limited to what fits in the msc-scratch.h
+ * buffer, to the drive's MAXIMUM TRANSFER LENGTH, if it reported one, and
+ * to the 65535 blocks a READ(10) or WRITE(10) command can move. Reads
+ * first write the dirty cached sectors to the drive. Writes store the byte
+ * offset in the buffer, modulo 256, in each byte and destroy whatever
+ * was on the drive; they end with msc_fat_sync() so the time includes
+ * emptying the drive's cache.
+ *
+ * @param pdrv the physical drive number
+ * @param write true to write, false to read
+ * @param start the first LBA
+ * @param blocks_per_cmd the blocks to transfer per command
+ * @param nblocks the number of blocks to transfer
+ * @param result set to what was transferred and how long it took
+ * @return DRESULT RES_OK, RES_PARERR if the range is not on the drive or
+ * blocks_per_cmd is 0, RES_NOTRDY if there is no drive or a command
+ * could not be queued, or RES_ERROR if a command failed or this core
+ * already holds the scratch buffer
+ */
+DRESULT msc_dd(BYTE pdrv, bool write, LBA_t start, UINT blocks_per_cmd, LBA_t nblocks, msc_dd_result_t* result);
+
+/**
+ * @brief get the throughput in hundredths of a megabyte (10^6 bytes) per second
+ */
+uint32_t msc_dd_rate_x100(const msc_dd_result_t* result);
+
+#ifdef __cplusplus
+}
+#endif
@@ -32,6 +32,12 @@
 #include "ff.h"
 #include "rp2040_rtc.h"
 #include "msc-demo-cli.h"
+#include "msc-recorder.h"
+#include "msc-copy-engine.h"
+#include "msc-bench.h"
+#include "msc-dd.h"
+#include "msc-stream.h"
+#include "msc-scratch.h"
 #include "pico/stdlib.h"
 static EmbeddedCli *cli;
 // Required functions for the CLI
@@ -63,18 +69,22 @@ static void on_get_free(EmbeddedCli *cli, char *args, void *context)
     (void)args;
     (void)context;
     FATFS* fs;
-    DWORD fre_clust, fre_sect, tot_sect;
+    DWORD fre_clust;
     FRESULT res = f_getfree("", &fre_clust, &fs);
     if (res != FR_OK) {
         printf("error %u getting free space\r\n", res);
         return;
     }
-    /* Get total sectors and free sectors */
-    tot_sect = (fs->n_fatent - 2) * fs->csize;
-    fre_sect = fre_clust * fs->csize;
-
-    /* Print the free space (assuming 512 bytes/sector) */
-    printf("%10lu KiB total drive space.\r\n%10lu KiB available.\r\n", tot_sect / 2, fre_sect / 2);
+#if FF_MAX_SS != FF_MIN_SS
+    uint32_t ssize = fs->ssize;
+#else
+    uint32_t ssize = FF_MAX_SS;
+#endif
+    /* Get total and free space in KiB */
+    uint64_t tot_kib = (uint64_t)(fs->n_fatent - 2) * fs->csize * ssize / 1024;
+    uint64_t fre_kib = (uint64_t)fre_clust * fs->csize * ssize / 1024;
+
+    printf("%10llu KiB total drive space.\r\n%10llu KiB available.\r\n", tot_kib, fre_kib);
 }
 
 static void on_cd(EmbeddedCli *cli, char *args, void *context)
@@ -171,7 +181,7 @@ static FRESULT scan_files(const char* path)
                 printf("%s/%s\r\n", path, fno.fname);
             }
             #endif
-            printf("%lu\t",fno.fsize);
+            printf("%llu\t",(unsigned long long)fno.fsize);
             print_fat_date(fno.fdate);
             print_fat_time(fno.ftime);
             printf("%s%c\r\n",fno.fname, (fno.fattrib & AM_DIR) ? '/' : ' ');
@@ -271,21 +281,14 @@ static void on_cat(EmbeddedCli *cli, char *args, void *context)
     (void)context;
     if (embeddedCliGetTokenCount(args) == 1) {
         char fn[256];
-        FIL fil;
         strncpy(fn, embeddedCliGetToken(args, 1), sizeof(fn)-1);
-        FRESULT res = f_open(&fil, fn, FA_READ);
+        fn[sizeof(fn)-1] = '\0';
+        /* Stream the file straight from the file's sector buffer to stdout */
+        FSIZE_t nbytes;
+        FRESULT res = msc_stream_file(fn, msc_stream_to_stdout, NULL, &nbytes);
         if (res != FR_OK) {
-            printf("error %u opening file %s\r\n", res, fn);
-            return;
+            printf("error %u reading file %s\r\n", res, fn);
         }
-        /* Read every line and display it */
-        char line[100];
-        while (f_gets(line, sizeof(line), &fil)) {
-            printf(line);
-        }
-
-        /* Close the file */
-        f_close(&fil);
     }
     else {
         printf("usage: cat filename\r\n");
@@ -371,6 +374,66 @@ static void on_mv(EmbeddedCli *cli, char *args, void *context)
     }
 }
 
+struct record_scratch {
+    msc_recorder_t rec;
+    uint32_t samples[1024];
+};
+static_assert(sizeof(record_scratch) <= MSC_SCRATCH_SIZE, "the recorder does not fit in MSC_SCRATCH_SIZE");
+
+static void on_record(EmbeddedCli *cli, char *args, void *context)
+{
+    (void)cli;
+    (void)context;
+    if (embeddedCliGetTokenCount(args) == 3) {
+        char fn[256];
+        strncpy(fn, embeddedCliGetToken(args, 1), sizeof(fn)-1);
+        fn[sizeof(fn)-1] = '\0';
+        FSIZE_t capacity = (FSIZE_t)strtoul(embeddedCliGetToken(args, 2), NULL, 10) * 1024;
+        FSIZE_t nbytes = (FSIZE_t)strtoul(embeddedCliGetToken(args, 3), NULL, 10) * 1024;
+        auto scratch = static_cast<record_scratch*>(msc_scratch_take());
+        if (scratch == NULL) {
+            printf("the scratch buffer is in use\r\n");
+            return;
+        }
+        msc_recorder_t& rec = scratch->rec;
+        uint32_t* samples = scratch->samples;
+        FRESULT res = msc_recorder_open(&rec, fn, capacity);
+        if (res != FR_OK) {
+            printf("error %u opening %s for recording\r\n", res, fn);
+            msc_scratch_give();
+            return;
+        }
+        // record a stream of 32-bit sample numbers
+        uint32_t sample = 0;
+        FSIZE_t recorded = 0;
+        uint64_t start = time_us_64();
+        while (res == FR_OK && recorded < nbytes) {
+            for (size_t idx = 0; idx < sizeof(scratch->samples)/sizeof(samples[0]); idx++) {
+                samples[idx] = sample++;
+            }
+            UINT len = nbytes - recorded < sizeof(scratch->samples) ? (UINT)(nbytes - recorded) : sizeof(scratch->samples);
+            UINT written;
+            res = msc_recorder_write(&rec, samples, len, &written);
+            recorded += written;
+            if (written < len)
+                break; // the recording is full
+        }
+        FRESULT close_res = msc_recorder_close(&rec);
+        uint64_t elapsed_us = time_us_64() - start;
+        msc_scratch_give();
+        if (res == FR_OK)
+            res = close_res;
+        if (res != FR_OK) {
+            printf("error %u recording %s\r\n", res, fn);
+        }
+        printf("%llu bytes recorded in %llu ms (%llu KB/s)\r\n", (unsigned long long)recorded, elapsed_us / 1000,
+            elapsed_us ? (unsigned long long)recorded * 1000 / elapsed_us : 0ull);
+    }
+    else {
+        printf("usage: record filename preallocate-KiB record-KiB\r\n");
+    }
+}
+
 static void on_cp(EmbeddedCli *cli, char *args, void *context)
 {
     (void)cli;
@@ -382,36 +445,16 @@ static void on_cp(EmbeddedCli *cli, char *args, void *context)
         fn1[sizeof(fn1)-1] = '\0';
         strncpy(fn2, embeddedCliGetToken(args, 2), sizeof(fn2)-1);
         fn2[sizeof(fn2)-1] = '\0';
-        FIL src, dest;
-        FRESULT res = f_open(&src, fn1, FA_READ);
+        msc_copy_result_t result;
+        FRESULT res = msc_copy_file(fn1, fn2, &result);
         if (res == FR_OK) {
-            res = f_open(&dest, fn2, FA_WRITE | FA_CREATE_NEW);
-            if (res == FR_OK) {
-                uint8_t buffer[512];
-                UINT nread = sizeof(buffer);
-                while (res == FR_OK && nread == sizeof(buffer)) {
-                    res = f_read(&src, buffer, sizeof(buffer), &nread);
-                    if (res == FR_OK) {
-                        UINT nwritten;
-                        res = f_write(&dest, buffer, nread, &nwritten);
-                    }
-                }
-                if (res == FR_OK) {
-                    printf("%s copied to %s\r\n", fn1, fn2);
-                }
-                else {
-                    printf("error %u copying %s to %s\r\n", res, fn1, fn2);
-                }
-                f_close(&src);
-                f_close(&dest);
-            }
-            else {
-                f_close(&src);
-                printf("error %u opening %s for writing\r\n", res, fn2);
-            }
+            uint32_t rate = msc_copy_rate_x100(&result);
+            printf("%s copied to %s: %llu bytes in %llu ms, %lu.%02lu MB/s%s\r\n", fn1, fn2,
+                (unsigned long long)result.bytes, result.elapsed_us / 1000, rate / 100, rate % 100,
+                result.pipelined ? "" : " (destination not contiguous; not pipelined)");
         }
         else {
-            printf("error %u opening %s for reading\r\n", res, fn1);
+            printf("error %u copying %s to %s\r\n", res, fn1, fn2);
         }
     }
     else {
@@ -419,6 +462,100 @@ static void on_cp(EmbeddedCli *cli, char *args, void *context)
     }
 }
 
+static void print_bench(const char* name, UINT xfer, const msc_bench_result_t* result)
+{
+    uint32_t rate = msc_bench_rate_x100(result);
+    printf("%-13s %5u B %4lu.%02lu MB/s %6lu IOPS, latency us p50 %lu p90 %lu p99 %lu max %lu\r\n", name, xfer,
+        rate / 100, rate % 100, msc_bench_iops(result), result->p50_us, result->p90_us, result->p99_us, result->max_us);
+}
+
+static void on_bench(EmbeddedCli *cli, char *args, void *context)
+{
+    (void)cli;
+    (void)context;
+    uint16_t argc = embeddedCliGetTokenCount(args);
+    int drive = argc >= 1 ? atoi(embeddedCliGetToken(args, 1)) : -1;
+    FSIZE_t size = argc == 2 ? (FSIZE_t)strtoul(embeddedCliGetToken(args, 2), NULL, 10) * 1024 : 1024 * 1024;
+    if (argc < 1 || argc > 2 || drive < 0 || drive > 3 || size < MSC_BENCH_RANDOM_SIZE) {
+        printf("usage: bench drive_number(0-3) <file-KiB(4 or more, default 1024)>\r\n");
+        return;
+    }
+    char path[] = "0:/bench.tmp";
+    char dir[] = "0:/bench.dir";
+    path[0] += drive;
+    dir[0] += drive;
+    static const UINT xfers[] = {512, 4096, MSC_BENCH_BUFFER_SIZE};
+    msc_bench_result_t result;
+    FRESULT res = FR_OK;
+    for (size_t idx = 0; res == FR_OK && idx < sizeof(xfers)/sizeof(xfers[0]); idx++) {
+        res = msc_bench_seq_write(path, size, xfers[idx], &result);
+        if (res == FR_OK) {
+            print_bench("seq write", xfers[idx], &result);
+            res = msc_bench_seq_read(path, xfers[idx], &result);
+            if (res == FR_OK)
+                print_bench("seq read", xfers[idx], &result);
+        }
+    }
+    if (res == FR_OK) {
+        res = msc_bench_random(path, false, 256, &result);
+        if (res == FR_OK)
+            print_bench("random read", MSC_BENCH_RANDOM_SIZE, &result);
+    }
+    if (res == FR_OK) {
+        res = msc_bench_random(path, true, 256, &result);
+        if (res == FR_OK)
+            print_bench("random write", MSC_BENCH_RANDOM_SIZE, &result);
+    }
+    f_unlink(path);
+    if (res == FR_OK) {
+        msc_bench_result_t del;
+        res = msc_bench_metadata(dir, 64, &result, &del);
+        if (res == FR_OK) {
+            print_bench("create", 0, &result);
+            print_bench("delete", 0, &del);
+        }
+    }
+    if (res != FR_OK) {
+        printf("error %u running the benchmark on drive %d\r\n", res, drive);
+    }
+}
+
+static void on_dd(EmbeddedCli *cli, char *args, void *context)
+{
+    (void)cli;
+    (void)context;
+    if (embeddedCliGetTokenCount(args) == 5) {
+        const char* dir = embeddedCliGetToken(args, 1);
+        bool write = strcmp(dir, "write") == 0;
+        int drive = atoi(embeddedCliGetToken(args, 2));
+        LBA_t start = (LBA_t)strtoull(embeddedCliGetToken(args, 3), NULL, 10);
+        UINT blocks_per_cmd = (UINT)strtoul(embeddedCliGetToken(args, 4), NULL, 10);
+        LBA_t nblocks = (LBA_t)strtoull(embeddedCliGetToken(args, 5), NULL, 10);
+        if ((write || strcmp(dir, "read") == 0) && drive >= 0 && drive <= 3) {
+            msc_dd_result_t result;
+            DRESULT res = msc_dd(drive, write, start, blocks_per_cmd, nblocks, &result);
+            if (res == RES_OK) {
+                uint32_t rate = msc_dd_rate_x100(&result);
+                printf("%s %llu blocks of %u B at LBA %llu: %lu commands of %u blocks in %llu ms, %lu.%02lu MB/s\r\n",
+                    write ? "wrote" : "read", (unsigned long long)result.blocks, result.block_size, (unsigned long long)start,
+                    result.commands, result.blocks_per_cmd, result.elapsed_us / 1000, rate / 100, rate % 100);
+                if (result.blocks_per_cmd < blocks_per_cmd)
+                    printf("blocks per command limited to %u by the buffer or the drive\r\n", result.blocks_per_cmd);
+            }
+            else if (res == RES_PARERR && result.block_size != 0) {
+                printf("LBA %llu and %llu blocks are not on the drive; the last LBA is %llu\r\n",
+                    (unsigned long long)start, (unsigned long long)nblocks, (unsigned long long)result.last_block);
+            }
+            else {
+                printf("error %u after %llu blocks at LBA %llu\r\n", res, (unsigned long long)result.blocks,
+                    (unsigned long long)start);
+            }
+            return;
+        }
+    }
+    printf("usage: dd read|write drive_number(0-3) start-LBA blocks-per-command total-blocks\r\n");
+}
+
 void msc_demo_cli_init()
 {
     uint16_t year;
@@ -439,7 +576,7 @@ void msc_demo_cli_init()
     demo_config.historyBufferSize = 128;
     demo_config.cliBuffer = NULL;
     demo_config.cliBufferSize = 0;
-    demo_config.maxBindingCount = 16;
+    demo_config.maxBindingCount = 19;
     demo_config.enableAutoComplete = true;
     demo_config.invitation = "> ";
 
@@ -447,6 +584,14 @@ void msc_demo_cli_init()
     cli->onCommand = onCommandFn;
     cli->writeChar = writeCharFn;
     bool result = embeddedCliAddBinding(cli, {
+            "bench",
+            "measure drive speed with a test file; usage bench drive_number(0-3) <file-KiB>",
+            true,
+            NULL,
+            on_bench
+    });
+    assert(result);
+    result = embeddedCliAddBinding(cli, {
             "cat",
             "print the specified file; usage cat filename",
             true,
@@ -478,6 +623,14 @@ void msc_demo_cli_init()
             on_cp
     });
     assert(result);
+    result = embeddedCliAddBinding(cli, {
+            "dd",
+            "time raw block transfers; write destroys the filesystem; usage dd read|write drive_number(0-3) start-LBA blocks-per-command total-blocks",
+            true,
+            NULL,
+            on_dd
+    });
+    assert(result);
     result = embeddedCliAddBinding(cli, {
             "get-date",
             "get the date for file timestamps; usage get-date",
@@ -542,6 +695,14 @@ void msc_demo_cli_init()
             on_pwd
     });
     assert(result);
+    result = embeddedCliAddBinding(cli, {
+            "record",
+            "record test data to a contiguous preallocated file; usage record filename preallocate-KiB record-KiB",
+            true,
+            NULL,
+            on_record
+    });
+    assert(result);
     result = embeddedCliAddBinding(cli, {
             "rm",
             "delete an unopened file or an unopened, empty directory; usage rm name",
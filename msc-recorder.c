@@ -0,0 +1,151 @@
+/**
+ * @file msc-recorder.c
+ * @brief record a data stream to a preallocated, contiguous file
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <assert.h>
+#include <string.h>
+#include "msc-recorder.h"
+#include "diskio.h"
+
+static_assert(MSC_RECORDER_BUFFER_SIZE % FF_MAX_SS == 0, "MSC_RECORDER_BUFFER_SIZE must be a multiple of FF_MAX_SS");
+
+static UINT msc_recorder_ss(msc_recorder_t* rec)
+{
+#if FF_MAX_SS != FF_MIN_SS
+    return rec->fil.obj.fs->ssize;
+#else
+    (void)rec;
+    return FF_MAX_SS;
+#endif
+}
+
+/**
+ * @brief write bytes to the file's data area, rounded up to whole sectors
+ *
+ * @param offset the sector aligned file offset of the first byte
+ */
+static FRESULT msc_recorder_put(msc_recorder_t* rec, const BYTE* data, FSIZE_t offset, UINT nbytes)
+{
+    UINT ss = msc_recorder_ss(rec);
+    LBA_t sector = rec->start_sector + offset / ss;
+    if (disk_write(rec->fil.obj.fs->pdrv, data, sector, (nbytes + ss - 1) / ss) != RES_OK)
+        return FR_DISK_ERR;
+    return FR_OK;
+}
+
+FRESULT msc_recorder_open(msc_recorder_t* rec, const TCHAR* path, FSIZE_t capacity)
+{
+    if (capacity == 0)
+        return FR_INVALID_PARAMETER;
+    FRESULT res = f_open(&rec->fil, path, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res != FR_OK)
+        return res;
+    res = f_expand(&rec->fil, capacity, 1);
+    if (res != FR_OK)
+    {
+        f_close(&rec->fil);
+        f_unlink(path);
+        return res;
+    }
+    FATFS* fs = rec->fil.obj.fs;
+    UINT ss = msc_recorder_ss(rec);
+    UINT cluster_bytes = (UINT)fs->csize * ss;
+    rec->length = 0;
+    rec->capacity = capacity;
+    rec->start_sector = fs->database + (LBA_t)fs->csize * (rec->fil.obj.sclust - 2);
+    rec->chunk = cluster_bytes < sizeof(rec->buf) ? cluster_bytes : sizeof(rec->buf);
+    rec->max_xfer = cluster_bytes / ss > 0x8000 ? 0x8000 * ss : cluster_bytes; // a request is at most 65535 sectors
+    rec->fill = 0;
+    return FR_OK;
+}
+
+FRESULT msc_recorder_write(msc_recorder_t* rec, const void* data, UINT len, UINT* written)
+{
+    const BYTE* src = (const BYTE*)data;
+    FRESULT res = FR_OK;
+    *written = 0;
+    if (len > rec->capacity - rec->length)
+        len = rec->capacity - rec->length;
+    while (res == FR_OK && len > 0)
+    {
+        UINT nbytes;
+        if (rec->fill == 0 && len >= rec->chunk)
+        {
+            // whole chunks go straight from the caller's buffer to the drive
+            nbytes = len / rec->chunk * rec->chunk;
+            if (nbytes > rec->max_xfer)
+                nbytes = rec->max_xfer;
+            res = msc_recorder_put(rec, src, rec->length, nbytes);
+        }
+        else
+        {
+            FSIZE_t buf_offset = rec->length - rec->fill;
+            nbytes = rec->chunk - rec->fill;
+            if (nbytes > len)
+                nbytes = len;
+            memcpy(rec->buf + rec->fill, src, nbytes);
+            rec->fill += nbytes;
+            if (rec->fill == rec->chunk)
+            {
+                res = msc_recorder_put(rec, rec->buf, buf_offset, rec->fill);
+                if (res == FR_OK)
+                    rec->fill = 0;
+                else
+                    rec->fill -= nbytes; // not appended; the bytes staged before stay for the next try
+            }
+        }
+        if (res == FR_OK)
+        {
+            rec->length += nbytes;
+            src += nbytes;
+            len -= nbytes;
+            *written += nbytes;
+        }
+    }
+    return res;
+}
+
+FRESULT msc_recorder_close(msc_recorder_t* rec)
+{
+    FRESULT res = FR_OK;
+    if (rec->fill != 0)
+    {
+        UINT ss = msc_recorder_ss(rec);
+        UINT padded = (rec->fill + ss - 1) / ss * ss;
+        memset(rec->buf + rec->fill, 0, padded - rec->fill);
+        res = msc_recorder_put(rec, rec->buf, rec->length - rec->fill, rec->fill);
+        if (res != FR_OK)
+            rec->length -= rec->fill; // keep only what reached the drive
+        rec->fill = 0;
+    }
+    FRESULT tres = f_lseek(&rec->fil, rec->length);
+    if (tres == FR_OK)
+        tres = f_truncate(&rec->fil);
+    if (res == FR_OK)
+        res = tres;
+    tres = f_close(&rec->fil);
+    return res == FR_OK ? tres : res;
+}
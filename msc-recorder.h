@@ -0,0 +1,91 @@
+/**
+ * @file msc-recorder.h
+ * @brief record a data stream to a preallocated, contiguous file
+ *
+ * A recording file is preallocated with f_expand() when it is opened,
+ * so the write path never touches the FAT or the directory. Data is
+ * written straight to the file's data sectors in transfers of whole
+ * clusters (or of MSC_RECORDER_BUFFER_SIZE bytes if that is smaller),
+ * and the file is truncated to the length recorded when it is closed.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#include "ff.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MSC_RECORDER_BUFFER_SIZE
+#define MSC_RECORDER_BUFFER_SIZE 16384 // bytes staged per recording; a multiple of FF_MAX_SS
+#endif
+
+typedef struct {
+    FIL fil;
+    FSIZE_t length;         // bytes recorded so far
+    FSIZE_t capacity;       // bytes preallocated
+    LBA_t start_sector;     // first sector of the contiguous data area
+    UINT chunk;             // bytes per staged transfer: a cluster or the whole buffer
+    UINT max_xfer;          // most bytes written straight from the caller in one transfer
+    UINT fill;              // bytes waiting in buf
+    BYTE buf[MSC_RECORDER_BUFFER_SIZE] __attribute__((aligned(4)));
+} msc_recorder_t;
+
+/**
+ * @brief create a recording file and preallocate it contiguously
+ *
+ * An existing file of the same name is replaced.
+ *
+ * @param rec the recorder; it is large, so do not put it on the stack
+ * @param path the file to create
+ * @param capacity the most bytes that will be recorded
+ * @return FRESULT FR_OK if the file is ready to record. FR_DENIED if
+ * the drive has no contiguous free area big enough.
+ */
+FRESULT msc_recorder_open(msc_recorder_t* rec, const TCHAR* path, FSIZE_t capacity);
+
+/**
+ * @brief append data to the recording
+ *
+ * @param rec the recorder
+ * @param data the bytes to append
+ * @param len the number of bytes to append
+ * @param written set to the number of bytes appended; less than len
+ * only if the recording is full or on error
+ * @return FRESULT FR_OK or the error from the drive
+ */
+FRESULT msc_recorder_write(msc_recorder_t* rec, const void* data, UINT len, UINT* written);
+
+/**
+ * @brief write the staged data, truncate the file to the recorded length and close it
+ *
+ * @param rec the recorder
+ * @return FRESULT FR_OK or the first error seen
+ */
+FRESULT msc_recorder_close(msc_recorder_t* rec);
+
+#ifdef __cplusplus
+}
+#endif
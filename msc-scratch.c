@@ -0,0 +1,54 @@
+/**
+ * @file msc-scratch.c
+ * @brief one large buffer shared by the record, cp, bench and dd tools
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <assert.h>
+#include "msc-scratch.h"
+#include "ff.h"
+#include "diskio.h"
+
+static_assert(MSC_SCRATCH_SIZE % FF_MAX_SS == 0, "MSC_SCRATCH_SIZE must be a multiple of FF_MAX_SS");
+
+static BYTE scratch_buf[MSC_SCRATCH_SIZE] __attribute__((aligned(8)));
+auto_init_recursive_mutex(scratch_lock);
+
+void* msc_scratch_take(void)
+{
+    msc_fat_mutex_enter(&scratch_lock, MSC_FAT_WAIT_FOREVER);
+    if (scratch_lock.enter_count > 1)
+    {
+        // a tool on this core already has the buffer; sharing it would
+        // overwrite that tool's data
+        recursive_mutex_exit(&scratch_lock);
+        return NULL;
+    }
+    return scratch_buf;
+}
+
+void msc_scratch_give(void)
+{
+    recursive_mutex_exit(&scratch_lock);
+}
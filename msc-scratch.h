@@ -0,0 +1,58 @@
+/**
+ * @file msc-scratch.h
+ * @brief one large buffer shared by the record, cp, bench and dd tools
+ *
+ * The tools need tens of kilobytes each for their transfer buffers and
+ * file objects; that is too big for the stack and too much RAM to keep
+ * for every tool. Only one tool uses the buffer at a time; a tool on the
+ * other core waits for it.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MSC_SCRATCH_SIZE
+#define MSC_SCRATCH_SIZE 36864 // bytes in the buffer; a multiple of FF_MAX_SS
+#endif
+
+/**
+ * @brief wait until the scratch buffer is free and take it
+ *
+ * @return void* the buffer, aligned for any type, or NULL if this core
+ * already holds it
+ */
+void* msc_scratch_take(void);
+
+/**
+ * @brief give back the buffer msc_scratch_take() returned
+ */
+void msc_scratch_give(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file msc-stream.c
+ * @brief stream file data to a consumer callback without copying it
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include "msc-stream.h"
+#include "diskio.h"
+
+// f_forward() calls its function with no context, so the stream in
+// progress is kept here. The lock keeps the other core out; it is
+// recursive, so a consumer may forward another open file.
+static msc_stream_consumer_t stream_consumer;
+static void* stream_context;
+auto_init_recursive_mutex(stream_lock);
+
+static UINT msc_stream_trampoline(const BYTE* data, UINT len)
+{
+    return stream_consumer(stream_context, len == 0 ? NULL : data, len);
+}
+
+FRESULT msc_stream_forward(FIL* fp, FSIZE_t nbytes, msc_stream_consumer_t consumer, void* context, FSIZE_t* forwarded)
+{
+    FRESULT res = FR_OK;
+    *forwarded = 0;
+    msc_fat_mutex_enter(&stream_lock, MSC_FAT_WAIT_FOREVER);
+    msc_stream_consumer_t outer_consumer = stream_consumer;
+    void* outer_context = stream_context;
+    stream_consumer = consumer;
+    stream_context = context;
+    while (res == FR_OK && nbytes > 0 && !f_eof(fp))
+    {
+        UINT btf = nbytes > 0x40000000 ? 0x40000000 : (UINT)nbytes;
+        UINT bf;
+        res = f_forward(fp, msc_stream_trampoline, btf, &bf);
+        *forwarded += bf;
+        nbytes -= bf;
+    }
+    stream_consumer = outer_consumer;
+    stream_context = outer_context;
+    recursive_mutex_exit(&stream_lock);
+    return res;
+}
+
+FRESULT msc_stream_file(const TCHAR* path, msc_stream_consumer_t consumer, void* context, FSIZE_t* forwarded)
+{
+    static FIL fil; // FIL holds a sector buffer; keep it off the stack
+    *forwarded = 0;
+    msc_fat_mutex_enter(&stream_lock, MSC_FAT_WAIT_FOREVER); // for fil
+    FRESULT res = f_open(&fil, path, FA_READ);
+    if (res == FR_OK)
+    {
+        res = msc_stream_forward(&fil, f_size(&fil), consumer, context, forwarded);
+        FRESULT close_res = f_close(&fil);
+        if (res == FR_OK)
+            res = close_res;
+    }
+    recursive_mutex_exit(&stream_lock);
+    return res;
+}
+
+UINT msc_stream_to_stdout(void* context, const BYTE* data, UINT len)
+{
+    (void)context;
+    if (len == 0)
+        return 1; // stdout is always ready
+    return fwrite(data, 1, len, stdout);
+}
+
+UINT msc_stream_to_file(void* context, const BYTE* data, UINT len)
+{
+    if (len == 0)
+        return 1;
+    UINT written;
+    if (f_write((FIL*)context, data, len, &written) != FR_OK)
+        return 0;
+    return written;
+}
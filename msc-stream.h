@@ -0,0 +1,91 @@
+/**
+ * @file msc-stream.h
+ * @brief stream file data to a consumer callback without copying it
+ *
+ * These functions use f_forward(), which hands the consumer pointers into
+ * the file object's sector buffer. The data is only valid during the
+ * call. Because f_forward() gives its callback no context argument, a
+ * stream started on one core waits for a stream on the other core to end.
+ *
+ * MIT License
+
+ * Copyright (c) 2022 rppicomidi
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#pragma once
+#include "ff.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief a consumer of streamed file data
+ *
+ * @param context the context passed to msc_stream_forward()
+ * @param data the next bytes of the file, or NULL to ask if the consumer is ready
+ * @param len the number of bytes at data; 0 when asking if the consumer is ready
+ * @return UINT when asked if ready, nonzero if the consumer can take data now.
+ * Otherwise, the number of bytes consumed (1..len), or 0 to abort the stream
+ * with FR_INT_ERR.
+ */
+typedef UINT (*msc_stream_consumer_t)(void* context, const BYTE* data, UINT len);
+
+/**
+ * @brief forward bytes from the file pointer of an open file to the consumer
+ *
+ * Blocks until nbytes have been forwarded or the end of the file is
+ * reached; while the consumer is not ready, this function spins.
+ *
+ * @param fp the file, opened with FA_READ
+ * @param nbytes the most bytes to forward
+ * @param consumer the function that takes the data
+ * @param context passed to the consumer
+ * @param forwarded set to the number of bytes forwarded
+ * @return FRESULT FR_OK or an error from f_forward()
+ */
+FRESULT msc_stream_forward(FIL* fp, FSIZE_t nbytes, msc_stream_consumer_t consumer, void* context, FSIZE_t* forwarded);
+
+/**
+ * @brief forward a whole file to the consumer
+ *
+ * @param path the file to stream
+ * @param consumer the function that takes the data
+ * @param context passed to the consumer
+ * @param forwarded set to the number of bytes forwarded
+ * @return FRESULT FR_OK or the first error opening, reading or closing the file
+ */
+FRESULT msc_stream_file(const TCHAR* path, msc_stream_consumer_t consumer, void* context, FSIZE_t* forwarded);
+
+/**
+ * @brief a consumer that writes the data to stdout; context is not used
+ */
+UINT msc_stream_to_stdout(void* context, const BYTE* data, UINT len);
+
+/**
+ * @brief a consumer that appends the data to a file; context is the FIL*,
+ * opened with FA_WRITE
+ */
+UINT msc_stream_to_file(void* context, const BYTE* data, UINT len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -79,16 +79,83 @@ static void blink_led(void)
     }
 }
 
-void main_loop_task()
+static void main_loop_task()
 {
 #if !defined(CFG_TUH_RPI_PIO_USB) || (CFG_TUH_RPI_PIO_USB == 0)
     tuh_task();
+    msc_fat_usb_task();
 #endif
+    msc_fat_task();
     msc_demo_cli_task();
 
     blink_led();
 }
 
+#if FF_FS_FREE_SCAN
+// Count the free clusters of the mounted drives a FAT sector at a time so
+// get-free does not have to scan the whole FAT. Drives that FatFs has not
+// mounted yet or that are already counted are skipped, so once every
+// drive is counted this takes no lock and reads nothing. This reads the
+// drive, so call it only from the main loop, not from a tinyusb callback.
+static void free_scan_task(void)
+{
+    static uint8_t next = 0;
+    for (uint8_t idx = 0; idx < FF_VOLUMES; idx++) {
+        uint8_t pdrv = (next + idx) % FF_VOLUMES;
+        // Checked without the volume lock; a stale value only skips a
+        // drive for one pass or makes one f_scanfree() call that does nothing
+        if (fatfs[pdrv].fs_type == 0 || fatfs[pdrv].scan_clst == 0xFFFFFFFF)
+            continue;
+        char path[3] = "0:";
+        path[0] += pdrv;
+        f_scanfree(path, 1);
+        next = (pdrv + 1) % FF_VOLUMES;
+        return;
+    }
+}
+#endif
+
+static volatile bool capacity_pending[FF_VOLUMES]; // set when a drive's inquiry completes
+
+static void print_capacity(uint64_t block_count, uint32_t block_size)
+{
+    printf("Disk Size: %llu MB\r\n", block_count / ((1024*1024)/block_size));
+    printf("Block Count = %llu, Block Size: %lu\r\n", block_count, block_size);
+}
+
+// Print the capacity of drives that finished their inquiry. A new drive
+// is initialized first, which reads it, so call this only from the main
+// loop.
+static void capacity_task(void)
+{
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++) {
+        if (!capacity_pending[pdrv])
+            continue;
+        capacity_pending[pdrv] = false;
+        LBA_t block_count;
+        WORD block_size;
+        if (disk_status(pdrv) & STA_NOINIT)
+            disk_initialize(pdrv);
+        if ((disk_status(pdrv) & STA_NOINIT) == 0 && disk_ioctl(pdrv, GET_SECTOR_COUNT, &block_count) == RES_OK &&
+                disk_ioctl(pdrv, GET_SECTOR_SIZE, &block_size) == RES_OK) {
+            print_capacity(block_count, block_size);
+        }
+        else {
+            printf("drive %u capacity is not available\r\n", pdrv);
+        }
+    }
+}
+
+// msc_fat_task() finishes unplugging a drive that was in use, so report
+// lost writes here rather than in tuh_msc_umount_cb()
+static void lost_writes_task(void)
+{
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++) {
+        if (msc_fat_writes_lost(pdrv))
+            printf("cached writes to drive %u were lost\r\n", pdrv);
+    }
+}
+
 #if CFG_TUH_RPI_PIO_USB
 // core1: handle host events
 static volatile bool core1_booting = true;
@@ -102,6 +169,7 @@ void core1_main() {
     }
     while (true) {
         tuh_task(); // tinyusb host task
+        msc_fat_usb_task(); // issue commands queued from core0
     }
 }
 #endif
@@ -144,6 +212,11 @@ int main()
 #endif
     while (1) {
         main_loop_task();
+        capacity_task();
+        lost_writes_task();
+#if FF_FS_FREE_SCAN
+        free_scan_task();
+#endif
     }
 }
 
@@ -164,12 +237,11 @@ bool inquiry_complete_cb(uint8_t dev_addr, tuh_msc_complete_data_t const* cb_dat
     // Print out Vendor ID, Product ID and Rev
     printf("%.8s %.16s rev %.4s\r\n", inquiry_resp.vendor_id, inquiry_resp.product_id, inquiry_resp.product_rev);
 
-    // Get capacity of device
-    uint32_t const block_count = tuh_msc_get_block_count(dev_addr, cb_data->cbw->lun);
-    uint32_t const block_size = tuh_msc_get_block_size(dev_addr, cb_data->cbw->lun);
-
-    printf("Disk Size: %lu MB\r\n", block_count / ((1024*1024)/block_size));
-    printf("Block Count = %lu, Block Size: %lu\r\n", block_count, block_size);
+    // disk_initialize() reads the capacity, with READ CAPACITY(16) if the
+    // drive has 2^32 blocks or more; it blocks, so print it from the main loop
+    uint8_t pdrv = msc_daddr_to_pdrv(dev_addr);
+    if (pdrv < FF_VOLUMES)
+        capacity_pending[pdrv] = true;
 
     return true;
 }
@@ -198,12 +270,14 @@ void tuh_msc_mount_cb(uint8_t dev_addr)
 
 void tuh_msc_umount_cb(uint8_t dev_addr)
 {
-    uint8_t pdrv = msc_unmap_pdrv(dev_addr);
+    uint8_t pdrv = msc_daddr_to_pdrv(dev_addr);
     char path[3] = "0:";
     path[0] += pdrv;
 
-    f_mount(NULL, path, 0); // unmount disk
+    // The drive is gone, so unplug it before anything waits for it
     msc_fat_unplug(pdrv);
+    f_mount(NULL, path, 0); // unmount disk
+    msc_unmap_pdrv(dev_addr);
     printf("Mass Storage drive %u is unmounted\r\n", pdrv);
 }
 